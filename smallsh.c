@@ -6,58 +6,789 @@
 // CS 344, Winter 2018
 //
 
+#define _GNU_SOURCE  // For pipe2() and other Linux extras
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/wait.h>
+#include <sys/resource.h> // For wait4() resource usage
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>  // For signals
+#include <getopt.h>  // For startup options
+#include <spawn.h>   // For posix_spawn() launch engine
+#include <errno.h>
+#include <sys/stat.h> // For checking cached command paths
+#include <time.h>
+#include <sys/sendfile.h> // For the in-shell copy fast path
+#include <sched.h>    // For sched_getaffinity()
+#include <sys/socket.h> // For handing commands to pool workers
+#include <sys/prctl.h>
+#include <sys/syscall.h> // For getdents64() in glob expansion
+#include <dirent.h>
+#include <sys/mman.h> // For mapping compiled scripts
+#include <limits.h>
+#include <sys/epoll.h>    // For the event loop, see event_wait()
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <netdb.h>        // For remote agents, see shell_remote()
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+extern char **environ;
 
 // Functions
 void shell_loop(void);
-char *shell_read_line(void);
-char **shell_split_line(char *line);
-int shell_execute(char **args);
-int shell_launch(char **args);
-void background_check(int size, pid_t bgProcesses[]);
-void kill_processes(int size, pid_t bgProcesses[]);
+char *shell_expand(char *line);
+struct arena;
+struct command;
+struct launch_spec;
+struct job;
+struct redirection;
+int shell_parse_input(char *line, struct command **result);
+void glob_expand_pipeline(struct arena *arena, struct command *pipeline);
+int shell_expand_pipeline(struct command *pipeline);
+int shell_parse_line(struct arena *arena, char *line, struct command **result);
+struct command *command_new(struct arena *arena);
+void command_add_arg(struct arena *arena, struct command *command, char *arg);
+void command_add_redirection(struct arena *arena, struct command *command,
+        int fd, int type, char *target);
+int shell_execute(struct command *command);
+int shell_execute_list(struct command *list);
+void launch_round_robin(int job);
+int cgroup_job_create(struct job *job, int index);
+void cgroup_job_release(struct job *job);
+void cgroup_teardown(void);
+void cgroup_report(struct job *job);
+int redirect_open(struct redirection *redir);
+int heredoc_open(struct redirection *redir);
+int heredoc_collect(struct command *list, char *(*next)(void *), void *source);
+char *input_body_line(void *unused);
+int builtin_lookup(const char *name);
+void shell_bench(void);
+void usage_report(FILE *out, const struct rusage *usage, double wall);
+int shell_launch(struct command *command);
+int launch_job(struct command *command, int background, int ownGroup);
+int fastcopy_try(struct command *command);
+int launch_open_redirects(struct command *stage, struct launch_spec *spec,
+        int stageIn, int stageOut, int nullIn, int nullOut);
+void launch_close_redirects(struct launch_spec *spec);
+int launch_add_dup(struct launch_spec *spec, int from, int childFD);
+pid_t launch_spawn(struct launch_spec *spec);
+pid_t launch_fork(struct launch_spec *spec);
+void launch_sh_argv(char **shArgv, const char *path, char **argv);
+void launch_exec(const char *path, char **argv);
+pid_t cgroup_fork(int cgroupFD);
+void event_init(int backend);
+void event_wait_input(void);
+void event_write(int fd, char *buffer, size_t length);
+void event_drain(void);
+void remote_service(void);
+void remote_flush(void);
+void remote_kill(struct job *job, int signo);
+void shell_suspend(void);
+void catchSIGIO(int signo);
+int agent_main(const char *address);
+pid_t pool_launch(struct launch_spec *spec);
+void pool_refill(void);
+void pool_resize(int size);
+void shell_parse_options(int argc, char **argv);
+void input_open(void);
+char *input_next_line(void);
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_grow(struct arena *arena, void *ptr, size_t oldSize, size_t newSize);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+int script_run(const char *path);
+const char *path_lookup(const char *name);
+void path_cache_clear(void);
+const char *shell_home(void);
+void env_changed(const char *name);
+void startup_mark(const char *phase);
+int background_check(void);
+void foreground_wait(int job);
+struct job;
+void catchSIGCHLD(int signo);
+void job_process_done(int index, int i, int waitStatus, const struct rusage *usage);
+void usage_add(struct rusage *total, const struct rusage *usage);
+void trace_open(const char *file);
+char *trace_describe(struct command *command);
+void trace_job(struct job *job);
+void kill_processes(void);
+int job_create(struct command *command, int background);
+void job_add_process(int job, pid_t pid, int failStatus);
+int job_final_status(struct job *job);
+void job_release(int job);
+int job_find_pid(pid_t pid);
+int job_parse_spec(const char *spec, const char *builtin);
+void catchShellSIGINT(int signo);
+void job_signal(struct job *job, int signo);
+void job_continue(int job, int background);
 void catchSIGTSTP(int signo);
 
+// Built-in commands, the one place they are declared. Each entry gives
+// the command's name and the function running it, the prototypes, the
+// builtin_str/builtin_func tables and the lookup hash are all generated
+// from this list and SHELL_PREFIXES below.
+#define SHELL_BUILTINS(BUILTIN) \
+    BUILTIN("cd", shell_cd) \
+    BUILTIN("exit", shell_exit) \
+    BUILTIN("status", shell_status) \
+    BUILTIN("hash", shell_hash) \
+    BUILTIN("set", shell_set) \
+    BUILTIN("shstat", shell_shstat) \
+    BUILTIN("parallel", shell_parallel) \
+    BUILTIN("pool", shell_pool) \
+    BUILTIN("jobs", shell_jobs) \
+    BUILTIN("fg", shell_fg) \
+    BUILTIN("bg", shell_bg) \
+    BUILTIN("wait", shell_wait) \
+    BUILTIN("source", shell_source) \
+    BUILTIN("export", shell_export) \
+    BUILTIN("unset", shell_unset) \
+    BUILTIN("coproc", shell_coproc)
+
+// Prefix commands, which run the rest of the command (a pipeline too)
+// some other way. They are looked up with the builtins, but their
+// functions are given the whole command instead of argv.
+#define SHELL_PREFIXES(PREFIX) \
+    PREFIX("time", shell_time) \
+    PREFIX("iotune", shell_iotune) \
+    PREFIX("limit", shell_limit) \
+    PREFIX("pin", shell_limit) \
+    PREFIX("remote", shell_remote)
+
 // Built-in commands functions
-int shell_cd(char **args);
-int shell_exit(char **args);
-int shell_status(char **args);
+#define BUILTIN_PROTOTYPE(name, func) int func(char **args);
+SHELL_BUILTINS(BUILTIN_PROTOTYPE)
+#define PREFIX_PROTOTYPE(name, func) int func(struct command *command);
+SHELL_PREFIXES(PREFIX_PROTOTYPE)
+void builtin_table_build(void);
+void stats_report(FILE *out);
+void stats_record(long *histogram, long *total, long ns);
 
 /***                       ***/
 /***    Global variables   ***/
 /***                       ***/
 
-// Flags used for redirection and background
-int in;
-int out;
-int isBackground = 0;
+// Tokens produced by the tokenizer
+#define TOK_END 0
+#define TOK_WORD 1
+#define TOK_PIPE 2    // |
+#define TOK_AMP 3     // &
+#define TOK_LESS 4    // [n]<
+#define TOK_GREAT 5   // [n]>
+#define TOK_DGREAT 6  // [n]>>
+#define TOK_SEMI 7    // ;
+#define TOK_AND 8     // &&
+#define TOK_OR 9      // ||
+#define TOK_LESSAND 10  // [n]<&
+#define TOK_GREATAND 11 // [n]>&
+#define TOK_DLESS 12    // [n]<<
+#define TOK_TLESS 13    // [n]<<<
+struct token {
+    int type;
+    char *text;       // The word, for TOK_WORD
+    int ioNumber;     // Descriptor given before a redirection, -1 if none
+};
+
+// Tokenizer state, so more than one line can be tokenized at a time
+struct scanner {
+    char *p;          // Next character to look at
+    char held;        // Character overwritten by the NUL ending the last word
+};
+
+// Redirections of a command's file descriptors
+#define REDIR_IN 0      // < file
+#define REDIR_OUT 1     // > file
+#define REDIR_APPEND 2  // >> file
+#define REDIR_DUP_IN 3  // <&N, a copy of the shell's descriptor N
+#define REDIR_DUP_OUT 4 // >&N
+#define REDIR_HEREDOC 5 // <<WORD, the lines up to WORD
+#define REDIR_HERESTRING 6 // <<< word, the word and a newline
+struct redirection {
+    int fd;             // Descriptor in the child being redirected
+    int type;           // One of the REDIR_ types above
+    char *target;       // File name, or descriptor number for the dups.
+                        // For a heredoc the delimiter until the body is
+                        // read by heredoc_collect(), then the body.
+};
+
+// Heredoc and here-string bodies up to this size go through a pipe, the
+// shell can write all of it before the command runs. Bigger ones go in
+// a memfd. Neither touches the file system.
+#define HEREDOC_PIPE_MAX 65536
+
+// A parsed command. Pipelines are a list of commands linked by next,
+// one per stage, and the first stage says if it runs in the background.
+struct command {
+    char **argv;        // Arguments, NULL terminated
+    int argc;
+    int argvSize;       // Entries allocated for argv
+    struct redirection *redirs; // Applied in order
+    int numRedirs;
+    int background;     // Ended with &
+    int timed;          // Run under the time prefix, report resource usage
+    struct command *next; // Next pipeline stage, reading this one's output
+    int connector;      // How the first stage is joined to nextInList, a LIST_ value
+    struct command *nextInList; // Next pipeline of a ; && || list
+};
+
+// Connectors between the pipelines of a command list
+#define LIST_END 0      // Last pipeline of the line
+#define LIST_SEQ 1      // ; run the next one regardless
+#define LIST_AND 2      // && run the next one if this one succeeded
+#define LIST_OR 3       // || run the next one if this one failed
+
+// What launch_spawn()/launch_fork() need to start one process
+struct fd_action {
+    int parentFD;       // Descriptor open in the shell
+    int childFD;        // Descriptor it becomes in the child
+    int shellOwned;     // Close parentFD in the shell after launching
+};
+struct launch_spec {
+    const char *path;   // Full path of the program
+    char **argv;
+    struct fd_action *fds; // Applied in order in the child
+    int numFds;
+    pid_t pgid;         // -1 keeps the shell's group, 0 starts a new one
+    int background;     // Background processes keep ignoring SIGINT
+    int jobControl;     // Monitor mode, the process can be stopped with SIGTSTP
+    int cgroupFD;       // Job's cgroup to start the process in, -1 for none
+};
+
+// Input commands are read from, either stdin or a script file. Reads go
+// into one large reusable buffer and lines are handed out in place.
+#define INPUT_BUFFSIZE 65536
+struct shell_input {
+    int fd;
+    char *buffer;
+    size_t size;   // Bytes allocated for buffer
+    size_t start;  // Start of data not handed out yet
+    size_t end;    // End of data read so far
+    int eof;       // Nothing more to read
+};
+struct shell_input shellInput = {0};
+
+// Prompt is only printed when reading commands from a terminal
+int interactive = 1;
+
+// Arena for everything parsed out of one command line (the expanded
+// line, token array and so on). Allocation just bumps a pointer, and it
+// is all released at once by arena_reset() at the end of each command.
+// Chunks are kept across resets so later commands reuse them.
+#define ARENA_CHUNK 65536
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;           // Bytes available in data
+    size_t used;           // Bytes handed out from data
+    char data[];
+};
+struct arena {
+    struct arena_chunk *first;
+    struct arena_chunk *current; // Chunk allocations come from
+    size_t inUse;          // Bytes handed out since the last reset
+    size_t peak;           // Most bytes ever in use at once
+};
+struct arena shellArena = {0};
+
+// Parse cache, maps a raw input line to its parsed command list so
+// lines repeated by loops and scripts skip parsing. Each entry keeps
+// the parse flattened into one block, with offsets instead of pointers,
+// that is copied into the arena and given pointers again on a hit. The
+// parse is from before $ expansion, which is done on every run. Entries
+// are kept in LRU order, at most PARSE_CACHE_SIZE.
+#define PARSE_CACHE_SIZE 256
+#define PARSE_CACHE_BUCKETS 512   // Power of two
+struct parse_entry {
+    unsigned long long hash;    // FNV-1a of the raw line
+    char *line;                 // Raw line, before expansion
+    char *blob;                 // Flattened parse, see parse_cache_flatten()
+    size_t blobSize;
+    struct parse_entry *chain;  // Next entry in the same bucket
+    struct parse_entry *newer, *older; // LRU list
+};
+struct parse_entry *parseBuckets[PARSE_CACHE_BUCKETS];
+struct parse_entry *parseNewest = NULL, *parseOldest = NULL;
+int parseCount = 0;
+
+// Directory listings read for glob expansion, so globs repeated by a
+// script don't read the same directory again. Entries are keyed by the
+// directory's device and inode and only used while its mtime is
+// unchanged. A listing taken right after the directory changed might
+// have missed a change made in the same mtime tick, so it is only
+// trusted once it is GLOB_SETTLE_NS older than the mtime.
+#define GLOB_DIR_CACHE_SIZE 32
+#define GLOB_SETTLE_NS 100000000L   // 100ms
+struct glob_dir {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int settled;        // Listed long enough after the last change to trust
+    char **names;       // Entries, . and .. left out, in one block with the text
+    int numNames;
+};
+struct glob_dir globDirs[GLOB_DIR_CACHE_SIZE];
+int globDirNext = 0;    // Slot replaced next, round robin
+
+// Flattened command, one per pipeline stage. Indexes are into the same
+// block's arrays, -1 for none.
+struct flat_command {
+    int argc;
+    int firstArg;       // Index of argv[0] in the argument offsets
+    int numRedirs;
+    int firstRedir;
+    int background;
+    int connector;
+    int next;           // Next pipeline stage
+    int nextInList;     // Next pipeline of the list
+};
+struct flat_redirection {
+    int fd;
+    int type;
+    size_t target;      // Offset of the file name in the block
+};
+
+// Compiled scripts. A script run by source, or given on the command line,
+// has the parse of its lines saved in a file named by the hash of the
+// script's text under $XDG_CACHE_HOME/smallsh (~/.cache/smallsh). Later
+// runs of the same text mmap() the file and inflate each line's parse
+// instead of parsing it. The file holds
+//   struct script_header
+//   struct script_line lines[numLines]
+//   char text[textSize]      copy of the script, compared on load
+//   flattened parses         see parse_cache_flatten(), 8 byte aligned
+// The parses are from before $ expansion, so lines with parameters are
+// compiled too and expanded on every run.
+#define SCRIPT_CACHE_MAGIC 0x31435353u   // "SSC1", change with the format
+#define SCRIPT_CACHE_LAYOUT (unsigned int)(sizeof(struct flat_command) << 16 \
+        | sizeof(struct flat_redirection) << 8 | sizeof(size_t))
+#define SCRIPT_LINE_PARSE 0   // Parsed when run: it has a syntax error, or wasn't reached
+#define SCRIPT_LINE_EMPTY 1   // Blank or a comment, nothing to run
+#define SCRIPT_LINE_BLOB 2    // Run from its flattened parse
+#define SOURCE_MAX_DEPTH 64   // Scripts sourcing scripts
+struct script_header {
+    unsigned int magic;
+    unsigned int layout;      // Flattened struct sizes, files from other builds are ignored
+    unsigned long long hash;  // FNV-1a of the text
+    unsigned long long textSize;
+    unsigned long long numLines;
+};
+struct script_line {
+    unsigned long long kind;
+    unsigned long long blob;  // Offset of the flattened parse in the file
+    unsigned long long blobSize;
+};
+int sourceDepth = 0;
+
+// The shell's PID as text, it never changes so $$ just copies it
+char shellPid[16];
 
-// File names for I/O
-char* inputFile;
-char* outputFile;
+// PID of the last background command, for $!
+pid_t lastBackgroundPid = 0;
+
+// The shell's ends of the coprocess's pipes, -1 when there is none. They
+// are close-on-exec, commands only get them through <&N and >&N.
+int coprocRead = -1;   // The coprocess's stdout
+int coprocWrite = -1;  // The coprocess's stdin
 
 // Sigaction structs
 struct sigaction SIGINT_action = {0};
 struct sigaction SIGTSTP_action = {0};
+struct sigaction SIGCHLD_action = {0};
+struct sigaction SIGIO_action = {0};
+
+// Signal mask the shell started with, given to every launched child.
+// The shell itself blocks SIGCHLD while it launches and waits.
+sigset_t childMask;
+sigset_t SIGCHLD_set;
+
+// Job table, tracks every child the shell launched until it is reported.
+// Jobs live in a growable slab indexed by job number - 1, unused slots
+// are chained on a free list and running jobs on a live list, so finding
+// and walking jobs costs O(live jobs). A pid to job hash index lets the
+// SIGCHLD handler find a process's job in O(1).
+// The handler reads the table, so it is only changed with SIGCHLD blocked.
+#define JOB_FREE 0     // Slot is on the free list
+#define JOB_RUNNING 1  // Some processes are still running
+#define JOB_DONE 2     // Every process has been reaped
+#define JOB_STOPPED 3  // Every process still running is stopped
+struct job_process {
+    pid_t pid;             // 0 if this stage couldn't be launched
+    int status;            // Wait status once reaped
+    int stopped;           // Stopped by a signal, until continued
+};
+struct job {
+    int state;             // One of the JOB_ states above
+    int background;        // Launched with &, or put in the background since
+    int ownGroup;          // Has its own process group, instead of the shell's
+    pid_t pgid;            // Process group the job's processes are in
+    struct job_process *procs; // Processes making up the job, one per pipeline stage
+    int numProcs;
+    int numLive;           // Processes not reaped yet
+    int numStopped;        // Live processes that are stopped
+    int stopSignal;        // Signal that stopped the job last
+    int status;            // Wait status of the job, set once it is done
+    char *command;         // Command text, for reporting
+    int timed;             // Report usage when done, from the time prefix
+    struct timespec start; // When the job was launched
+    struct timespec end;   // When its last process was reaped
+    struct rusage usage;   // Summed over the job's processes, from wait4()
+    struct timespec launched; // Wall clock launch time, for the trace
+    long launchNs;         // Time spent starting the job's processes
+    char *trace;           // Stages as JSON for the trace, NULL if not tracing
+    int cgroupFD;          // The job's cgroup directory, -1 if it has none
+    char cgroupName[32];   // Its name under the shell's cgroup directory
+    int remoteHost;        // Agent running it, -1 for jobs run here
+    unsigned int remoteId; // Its id on the connection to that agent
+    int remoteFDs[3];      // Where its stdout and stderr go, -1 to drop them
+    int next;              // Next job on the free or live list
+    int prev;              // Previous job on the live list
+    int nextDone;          // Next job waiting to be reported as done
+};
+struct job *jobTable = NULL;
+int jobCapacity = 0;
+int jobFree = -1;                        // Head of the free list
+int jobLive = -1;                        // Head of the live list
+volatile sig_atomic_t jobDoneHead = -1;  // Finished background jobs, pushed by the handler
+int jobCurrent = -1;    // Job fg and bg use by default, the last one put in the background
+
+// Open addressing hash from pid to job, empty slots have pid 0
+struct pid_slot {
+    pid_t pid;
+    int job;
+};
+struct pid_slot *pidIndex = NULL;
+int pidIndexSize = 0;   // Always a power of two
+int pidIndexCount = 0;
+
+// Execution trace, one JSON line per finished job appended to this
+// descriptor, -1 when tracing is off. Turned on with --trace FILE or the
+// SMALLSH_TRACE environment variable.
+int traceFD = -1;
 
-// Tracker for background processes
-pid_t bgTracker[250] = {0};
-int numBGProcesses = 0;
+// Set by --bench, time the shell's own hot paths instead of reading commands
+int benchMode = 0;
 
+// Set by --agent, where to listen for shells sending commands
+const char *agentAddress = NULL;
 // Status variable, for passing to built in status
 int status = -5;
 
+// Resource usage of the last foreground job, for status -v and time
+struct rusage lastUsage;
+double lastWall = 0;
+long foregroundJobs = 0;  // Foreground jobs waited on so far
+
+// Result of the last command run in a list, builtins included, for &&
+// and ||. A wait status, like status.
+int commandStatus = 0;
+
 // Background switich variable
 int backgroundAllowed = 1;
 
+// Options changed with the set builtin
+int pipefail = 0; // Pipeline status is the last stage to fail, not the last stage
+int fastcopy = 0; // Copy files in the shell for plain cat < a > b commands
+int monitor = 0;  // Job control, every job gets its own process group and the terminal
+int parsecache = 1; // Reuse the parse of lines seen before
+int glob = 1;       // Expand * ? and [...] in arguments to matching file names
+int scriptcache = 1; // Keep compiled scripts on disk, see script_run()
+int roundrobin = 0;  // Pin each background job to the next CPU
+int cgroups = 0;     // Start every job in a cgroup of its own
+struct shell_option {
+    const char *name;
+    int *flag;
+};
+struct shell_option shellOptions[] = {
+    {"pipefail", &pipefail},
+    {"fastcopy", &fastcopy},
+    {"monitor", &monitor},
+    {"parsecache", &parsecache},
+    {"glob", &glob},
+    {"scriptcache", &scriptcache},
+    {"roundrobin", &roundrobin},
+    {"cgroups", &cgroups}
+};
+#define NUM_SHELL_OPTIONS (int)(sizeof(shellOptions) / sizeof(struct shell_option))
+
+// Counters for the shell's internal fast paths, shown by shstat
+// Plain increments in one cache line aligned struct, cheap enough to
+// always keep. Latencies go in histograms of power of two microsecond
+// buckets: bucket 0 is under 1us, bucket k is under 2^k us.
+#define STATS_BUCKETS 24
+struct shell_stats {
+    long commands;         // Pipelines run, builtins and others
+    long builtins;         // Of those, builtins
+    long externals;        // Of those, launched as jobs
+    long forkLaunches;     // Processes started with fork()
+    long spawnLaunches;    // Processes started with posix_spawn()
+    long poolLaunches;     // Commands handed to a pre-forked pool worker
+    long fastcopyTaken;    // cat commands done in the shell
+    long fastcopyDeclined; // cat commands with redirections that had to be launched
+    long pathHits;         // Commands found in the PATH cache
+    long pathMisses;       // Commands PATH had to be searched for
+    long parseHits;        // Lines found in the parse cache
+    long parseMisses;      // Lines that had to be parsed
+    long tokensPeak;       // Most tokens in one parsed line
+    long globDirHits;      // Directory listings globs took from the cache
+    long globDirReads;     // Directories globs had to read
+    long scriptHits;       // Scripts run from their compiled file
+    long scriptCompiled;   // Scripts compiled and saved
+    long jobsLive;         // Jobs in the job table now
+    long jobsPeak;         // The most there have been at once
+    long launchNs;         // Starting processes, until exec for posix_spawn
+    long launchHistogram[STATS_BUCKETS];
+    long waitNs;           // Waiting for foreground jobs
+    long waitHistogram[STATS_BUCKETS];
+} __attribute__((aligned(64)));
+struct shell_stats shellStats = {0};
+
+// How the command being run opens its redirection files, set by the
+// iotune prefix for the length of one command
+struct io_tune {
+    int active;
+    off_t preallocate;  // Reserve this much space in output files, 0 for none
+    int outputFlags;    // O_DIRECT and/or O_DSYNC for output files
+    int advice;         // posix_fadvise() advice for input files, -1 for none
+};
+struct io_tune ioTune = { 0, 0, 0, -1 };
+
+// How the command being run is started, set by the limit and pin
+// prefixes for the length of one command. They are applied in the
+// child between fork() and exec(), so these commands always take the
+// fork launch path.
+#define LAUNCH_NUM_LIMITS 3
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#endif
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+struct launch_attrs {
+    int active;
+    int limitsSet;      // Bit per entry of limits that was given
+    rlim_t limits[LAUNCH_NUM_LIMITS]; // CPU seconds, address space, open files
+    int niceSet;
+    int nice;
+    int ioprio;         // ioprio_set() value, -1 for none
+    int cpusSet;
+    cpu_set_t cpus;     // CPUs to run on
+    int memPolicy;      // set_mempolicy() mode, -1 for none
+    cpu_set_t memNodes; // NUMA nodes, a plain bit mask the same as the kernel's
+};
+const int launchLimitResources[LAUNCH_NUM_LIMITS] = { RLIMIT_CPU, RLIMIT_AS, RLIMIT_NOFILE };
+struct launch_attrs launchAttrs = { .ioprio = -1, .memPolicy = -1 };
+
+// cgroup v2 tracking of jobs (set -o cgroups). The shell makes a
+// smallsh-<pid> directory in its own cgroup, and each job a leaf in
+// there. Processes are started straight into their job's cgroup with
+// clone3(CLONE_INTO_CGROUP), falling back to fork() and joining it before
+// exec, so everything a job forks stays in its cgroup. That gives jobs -v
+// the job's memory, CPU and I/O use, and lets exit kill all of it with
+// cgroup.kill, children that left the process group included. A job's
+// cgroup is removed when the job is; if something it started outlived it
+// the cgroup is left for exit to clean up.
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+struct cgroup_clone_args { // struct clone_args from linux/sched.h
+    unsigned long long flags, pidfd, child_tid, parent_tid, exit_signal;
+    unsigned long long stack, stack_size, tls, set_tid, set_tid_size, cgroup;
+};
+int cgroupBaseFD = -1;  // The smallsh-<pid> directory
+char cgroupBasePath[PATH_MAX];
+int cgroupSequence = 0; // Makes job cgroup names unique
+
+// Round robin placement of background jobs (set -o roundrobin), each one
+// is pinned to the next of the CPUs the shell itself may run on
+cpu_set_t roundRobinCPUs;
+int roundRobinLoaded = 0;
+int roundRobinNext = 0;
+
+// Event loop the shell waits in for input, see event_wait_input(). It
+// wakes for stdin, for SIGCHLD and SIGTSTP (taken through a signalfd
+// while waiting, so background jobs are reported the moment they end),
+// and for trace records written in the background. io_uring is used
+// where the kernel has it, epoll otherwise.
+#define EVENT_NONE 0
+#define EVENT_EPOLL 1
+#define EVENT_URING 2
+#define EVENT_ENTRIES 64   // Ring size, and most trace writes in flight
+// What woke the loop, kept in each request's tag with its descriptor
+#define EVENT_INPUT 1
+#define EVENT_SIGNAL 2
+#define EVENT_CHILD 3
+#define EVENT_WRITE 4      // Descriptor part is the slot in eventWrites
+#define EVENT_CANCEL 5
+#define EVENT_TAG(kind, fd) ((unsigned long long)(kind) << 32 | (unsigned int)(fd))
+const char *eventBackendNames[] = { "none", "epoll", "io_uring" };
+struct event_loop {
+    int backend;
+    int fd;               // The epoll instance or the ring
+    int signalFD;
+    int inputArmed;       // io_uring polls fire once, re-armed each wait
+    int inputReady;
+    sigset_t signals;     // Taken through signalFD while waiting
+#ifdef HAVE_IO_URING
+    unsigned int *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned int sqEntries;
+    unsigned int toSubmit;
+#endif
+    char *writes[EVENT_ENTRIES]; // Buffers of writes in flight, freed when done
+    int numWrites;
+    int ringWrites;       // The ring can do the trace writes
+} eventLoop = { EVENT_NONE, -1, -1 };
+int eventBackend = EVENT_URING; // Asked for with --events
+
+// Set by the SIGINT handler installed while the shell itself does
+// something that SIGINT should cut short (copying a file, waiting)
+volatile sig_atomic_t shellInterrupted = 0;
+
+// Agents remote runs commands on, see shell_remote(). Each is one TCP
+// connection to smallsh --agent that all the jobs sent there share, in
+// frames of a header of three 32 bit numbers in network byte order (the
+// payload's length, its type and the job it is for) then the payload.
+#define REMOTE_HELLO 1     // To the agent, the token
+#define REMOTE_WELCOME 2   // To the shell, the agent's CPUs and jobs running
+#define REMOTE_REFUSED 3   // To the shell, the token was wrong
+#define REMOTE_RUN 4       // To the agent, a flags byte then the NUL terminated argv
+#define REMOTE_STDIN 5     // To the agent, input for the job, empty for the end
+#define REMOTE_KILL 6      // To the agent, a signal for the job's process group
+#define REMOTE_STDOUT 7    // To the shell, output of the job
+#define REMOTE_STDERR 8
+#define REMOTE_EXIT 9      // To the shell, the job's wait status and jobs running
+#define REMOTE_RUN_NOOUT 1 // RUN flag, the job's output is thrown away
+#define REMOTE_FRAME_MAX (1 << 20)
+#define REMOTE_CHUNK 65536 // Most input or output sent in one frame
+#define REMOTE_BATCH 65536 // Queued bytes that are flushed before more go on
+struct remote_buffer {
+    char *data;
+    size_t start;       // Bytes from start to end are queued, or read in
+    size_t end;         // and not handled yet
+    size_t size;
+};
+struct remote_host {
+    char *name;         // host:port, as given to remote -a
+    int fd;             // Connection to the agent, -1 once it is lost
+    int slots;          // CPUs the agent runs jobs on
+    int jobs;           // This shell's jobs running there
+    int others;         // Other shells' jobs running there, as of the last EXIT
+    struct remote_buffer in, out;
+};
+struct remote_host *remoteHosts = NULL;
+int numRemoteHosts = 0;
+unsigned int remoteNextId = 1;
+// Set by SIGIO, an agent connection has something to read
+volatile sig_atomic_t remoteReady = 0;
+
+// Launch engines for non built in commands. posix_spawn() lets libc use a
+// vfork style clone, so launch cost doesn't grow with the shell's memory.
+// Plain fork() is kept as a fallback.
+#define LAUNCH_SPAWN 0
+#define LAUNCH_FORK 1
+#ifdef _POSIX_SPAWN
+int launchEngine = LAUNCH_SPAWN;
+#else
+int launchEngine = LAUNCH_FORK;
+#endif
+const char *launchEngineNames[] = { "posix_spawn", "fork" };
+
+// Pool of pre-forked workers, turned on with the pool builtin. Each idle
+// worker is a fork of the shell blocked on its own socket, with the
+// child's signal setup already done. A launch just sends it the argv and
+// descriptors (over SCM_RIGHTS) and it calls execv() right away, so the
+// fork happens ahead of time instead of after Enter is pressed.
+// Workers inherit the shell's state when forked, poolGeneration is bumped
+// whenever that state changes (like the working directory) so older
+// workers get thrown away instead of used.
+#define POOL_MAX_FDS 16
+#define POOL_MESSAGE_SIZE 65536
+struct pool_worker {
+    pid_t pid;
+    int socket;         // Shell's end of the worker's socket
+    int generation;     // poolGeneration when the worker was forked
+};
+struct pool_request {
+    int background;     // Keep ignoring SIGINT
+    int jobControl;     // Default SIGTSTP instead of ignoring it
+    int numFds;         // Descriptors passed along with the request
+    int childFDs[POOL_MAX_FDS]; // Where each passed descriptor goes
+    int argc;           // Followed by the path and argv strings
+};
+struct pool_worker *poolWorkers = NULL; // Idle workers
+int poolIdle = 0;
+int poolSize = 0;       // Number of idle workers to keep, 0 for none
+int poolGeneration = 0;
+
+// Cache of where commands were found on PATH, so launching a command
+// doesn't probe every PATH directory each time. Shown by the hash builtin.
+#define PATH_CACHE_BUCKETS 64
+struct path_entry {
+    char *name;            // Command name as typed
+    char *path;            // Full path it was found at
+    struct timespec mtime; // Modification time of the binary when cached
+    int hits;              // Number of times this entry was used
+    struct path_entry *next;
+};
+struct path_entry *pathCache[PATH_CACHE_BUCKETS] = {0};
+char *pathCacheKey = NULL; // Value of PATH the cache was filled with
+
+// Environment values the shell needs often, looked up the first time they
+// are used. Only export and unset change the shell's environment, and
+// they call env_changed() to drop the copies.
+//   PATH  split into pathDirs once, searched by path_search()
+//   HOME  for cd
+struct path_dir {
+    const char *dir;    // Points into pathCacheKey, not NUL terminated
+    int length;         // 0 for the current directory
+};
+struct path_dir *pathDirs = NULL;
+int numPathDirs = 0;
+const char *homeDir = NULL;
+int homeLoaded = 0;
+
+// Time spent in each part of startup, printed with --startup-profile
+#define STARTUP_MAX_PHASES 8
+struct startup_phase {
+    const char *name;
+    long ns;
+};
+struct startup_phase startupPhases[STARTUP_MAX_PHASES];
+int numStartupPhases = 0;
+struct timespec startupLast;
+int startupProfile = 0;
+
 int main(int argc, char **argv)
 {
+    clock_gettime(CLOCK_MONOTONIC, &startupLast);
+
+    // Handle startup options before anything else
+    shell_parse_options(argc, argv);
+    startup_mark("options");
+    builtin_table_build();
+    startup_mark("builtins");
+
+    // Read commands from a script if one was given, otherwise stdin.
+    // The prompt is never printed for a script.
+    if (optind < argc) {
+        interactive = 0;
+    } else {
+        input_open();
+    }
+    snprintf(shellPid, sizeof(shellPid), "%d", (int)getpid());
+    startup_mark("input");
+
     // Signal handler setup
     SIGINT_action.sa_handler = SIG_IGN;
     sigfillset(&SIGINT_action.sa_mask);
@@ -66,35 +797,226 @@ int main(int argc, char **argv)
     SIGTSTP_action.sa_handler = catchSIGTSTP;
     SIGTSTP_action.sa_flags = SA_RESTART;
 
+    SIGCHLD_action.sa_handler = catchSIGCHLD;
+    sigfillset(&SIGCHLD_action.sa_mask);
+    // Stopped children are reported too, for job control
+    SIGCHLD_action.sa_flags = SA_RESTART;
+
+    // Agents' SIGIO is held off along with SIGCHLD, what they send
+    // finishes jobs too
+    SIGIO_action.sa_handler = catchSIGIO;
+    sigfillset(&SIGIO_action.sa_mask);
+    SIGIO_action.sa_flags = SA_RESTART;
+
+    sigprocmask(SIG_SETMASK, NULL, &childMask);
+    sigemptyset(&SIGCHLD_set);
+    sigaddset(&SIGCHLD_set, SIGCHLD);
+    sigaddset(&SIGCHLD_set, SIGIO);
+
+    // An agent runs commands for other shells and nothing else
+    if (agentAddress != NULL) {
+        return agent_main(agentAddress);
+    }
+
+    // Benchmarks reap their own children, so run them before the handlers
+    if (benchMode) {
+        shell_bench();
+        return EXIT_SUCCESS;
+    }
+
     // Register handlers
     sigaction(SIGINT, &SIGINT_action, NULL);
     sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+    sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+    sigaction(SIGIO, &SIGIO_action, NULL);
+    // Taking the terminal back from a job would stop the shell otherwise
+    signal(SIGTTOU, SIG_IGN);
+    startup_mark("signals");
+
+    // Only the interactive loop waits for input
+    if (optind >= argc) {
+        event_init(eventBackend);
+        startup_mark("events");
+    }
+
+    if (startupProfile) {
+        long total = 0;
+        for (int i = 0; i < numStartupPhases; i++) {
+            fprintf(stderr, "startup.%s %ldns\n", startupPhases[i].name, startupPhases[i].ns);
+            total += startupPhases[i].ns;
+        }
+        fprintf(stderr, "startup.total %ldns\n", total);
+    }
+
+    // Run user control loop, or the script. Reaching the end of the
+    // script leaves the same way exit does.
+    if (optind < argc) {
+        int result = script_run(argv[optind]);
+        if (result == -1) {
+            exit(EXIT_FAILURE);
+        }
+        if (result == 1) {
+            shell_exit(NULL);
+        }
+    } else {
+        shell_loop();
+    }
 
-    // Run user control loop.
-    shell_loop();
+#ifdef ARENA_STATS
+    // Built with -DARENA_STATS, report how big the command arena got
+    fprintf(stderr, "smallsh: arena peak %zu bytes\n", shellArena.peak);
+#endif
 
     return EXIT_SUCCESS;
 } // end main
 
+// Parses startup options given to smallsh
+//   --fork          always launch commands with fork() and exec()
+//   --spawn         launch commands with posix_spawn() (the default)
+//   --show-launch   report which launch path was chosen
+//   --startup-profile  print how long each part of startup took
+//   --events backend   wait for input with io_uring (the default), epoll or none
+//   --agent [address:]port  run commands sent by remote, see agent_main()
+void shell_parse_options(int argc, char **argv)
+{
+    static struct option longOptions[] = {
+        {"fork", no_argument, NULL, 'f'},
+        {"spawn", no_argument, NULL, 's'},
+        {"show-launch", no_argument, NULL, 'L'},
+        {"trace", required_argument, NULL, 't'},
+        {"bench", no_argument, NULL, 'B'},
+        {"monitor", no_argument, NULL, 'm'},
+        {"startup-profile", no_argument, NULL, 'P'},
+        {"events", required_argument, NULL, 'E'},
+        {"agent", required_argument, NULL, 'A'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+    int showLaunch = 0;
+
+    while ((opt = getopt_long(argc, argv, "+m", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'f':
+            launchEngine = LAUNCH_FORK;
+            break;
+        case 's':
+#ifdef _POSIX_SPAWN
+            launchEngine = LAUNCH_SPAWN;
+#else
+            fprintf(stderr, "smallsh: posix_spawn not available, using fork\n");
+#endif
+            break;
+        case 'L':
+            showLaunch = 1;
+            break;
+        case 't':
+            trace_open(optarg);
+            break;
+        case 'B':
+            benchMode = 1;
+            break;
+        case 'm':
+            monitor = 1;
+            break;
+        case 'P':
+            startupProfile = 1;
+            break;
+        case 'A':
+            agentAddress = optarg;
+            break;
+        case 'E':
+            for (eventBackend = EVENT_URING; eventBackend >= 0
+                    && strcmp(optarg, eventBackendNames[eventBackend]) != 0; eventBackend--);
+            if (eventBackend >= 0) {
+                break;
+            }
+            fprintf(stderr, "smallsh: --events: %s: want io_uring, epoll or none\n", optarg);
+            // Fall through to the usage message
+        default:
+            fprintf(stderr, "usage: smallsh [--fork | --spawn] [--show-launch] [--trace file] [--bench] [--startup-profile] [--events backend] [--agent [address:]port] [-m] [script]\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The flag wins over the environment
+    if (traceFD == -1 && getenv("SMALLSH_TRACE") != NULL && *getenv("SMALLSH_TRACE") != '\0') {
+        trace_open(getenv("SMALLSH_TRACE"));
+    }
+
+    if (showLaunch) {
+        printf("smallsh: launch engine is %s\n", launchEngineNames[launchEngine]);
+        fflush(stdout);
+    }
+}
+
 
-// Built in command list, to iterate over later
+// Built in command list, to iterate over later. The prefix commands'
+// names follow the builtins', so they get slots in the same hash.
+#define BUILTIN_NAME(name, func) name,
 char *builtin_str[] = {
-        "cd",
-        "exit",
-        "status"
+        SHELL_BUILTINS(BUILTIN_NAME)
+        SHELL_PREFIXES(BUILTIN_NAME)
 };
 
 // An array of function pointers to the built in command functions,
 // will be used in the execution function later.
+#define BUILTIN_FUNC(name, func) &func,
 int (*builtin_func[]) (char **) = {
-        &shell_cd,
-        &shell_exit,
-        &shell_status
+        SHELL_BUILTINS(BUILTIN_FUNC)
+};
+// And to the prefix commands, builtin_str index minus the builtins
+int (*prefix_func[]) (struct command *) = {
+        SHELL_PREFIXES(BUILTIN_FUNC)
 };
 
-// Helper function to return the number of built in commands in the array above
+// Helper function to return the number of built in commands in the array
+// above, the prefix commands come after them in builtin_str
 int shell_num_builtins() {
-    return sizeof(builtin_str) / sizeof(char *);
+    return sizeof(builtin_func) / sizeof(builtin_func[0]);
+}
+
+// Perfect hash from command name to builtin, so a lookup (or a miss)
+// costs one hash and at most one strcmp() however many builtins there
+// are. builtin_table_build() picks a seed at startup that gives every
+// builtin its own slot; slots hold the builtin's index, -1 if empty.
+#define BUILTIN_HASH_SIZE 128   // Power of two, kept over 4x the builtins
+_Static_assert(sizeof(builtin_str) / sizeof(char *) * 4 <= BUILTIN_HASH_SIZE,
+        "BUILTIN_HASH_SIZE is too small for the builtin list");
+signed char builtinSlots[BUILTIN_HASH_SIZE];
+unsigned int builtinSeed = 0;
+
+// Seeded FNV-1a hash of a command name
+unsigned int builtin_hash(const char *name, unsigned int seed)
+{
+    unsigned int hash = 2166136261u ^ seed;
+
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    // FNV's low bits mix poorly on short names, fold the high half in
+    return (hash ^ (hash >> 16)) & (BUILTIN_HASH_SIZE - 1);
+}
+
+// Finds a seed where no two builtins hash to the same slot
+void builtin_table_build(void)
+{
+    int i, num_builtins = sizeof(builtin_str) / sizeof(char *);
+    unsigned int slot;
+
+    for (builtinSeed = 0; ; builtinSeed++) {
+        memset(builtinSlots, -1, sizeof(builtinSlots));
+        for (i = 0; i < num_builtins; i++) {
+            slot = builtin_hash(builtin_str[i], builtinSeed);
+            if (builtinSlots[slot] != -1) {
+                break;
+            }
+            builtinSlots[slot] = i;
+        }
+        if (i == num_builtins) {
+            return;
+        }
+    }
 }
 
 /*** Implementing built-in functions cd, exit, and status ***/
@@ -106,22 +1028,27 @@ int shell_cd(char **args)
 {
     // Check arguments, if none, change to home directory
     if (args[1] == NULL) {
-        if (chdir(getenv("HOME")) != 0) {
+        if (chdir(shell_home()) != 0) {
             perror("smallsh");
+            commandStatus = EXIT_FAILURE << 8;
         }
     }
     // If ~ given, change to home direcotry
     else if (strcmp(args[1],"~") == 0) {
-        if (chdir(getenv("HOME")) != 0) {
+        if (chdir(shell_home()) != 0) {
             perror("smallsh");
+            commandStatus = EXIT_FAILURE << 8;
         }
     }
     // Else, invalid argument, error thrown
     else {
         if (chdir(args[1]) != 0) {
             perror("smallsh");
+            commandStatus = EXIT_FAILURE << 8;
         }
     }
+    // Pool workers forked before this are in the old directory
+    poolGeneration++;
     return 1;
 }
 
@@ -130,11 +1057,203 @@ int shell_cd(char **args)
 int shell_exit(char **args)
 {
     // Kill off any background processes before exiting
-    kill_processes(numBGProcesses, bgTracker);
+    kill_processes();
+    // Send agents the kills, they drop the rest when the connection goes
+    remote_flush();
+    pool_resize(0);
+    // Trace records still being written
+    event_drain();
+    // SMALLSH_STATS=file dumps the counters there on the way out, - for stderr
+    const char *statsFile = getenv("SMALLSH_STATS");
+    if (statsFile != NULL && *statsFile != '\0') {
+        FILE *out = strcmp(statsFile, "-") == 0 ? stderr : fopen(statsFile, "ae");
+        if (out == NULL) {
+            fprintf(stderr, "smallsh: stats: %s: %s\n", statsFile, strerror(errno));
+        } else {
+            stats_report(out);
+            if (out != stderr) fclose(out);
+        }
+    }
     // Return 0 to break loop and return control to end of main function
     return 0;
 }
 
+// Built in source command, runs the commands in a file in this shell, so
+// cd, set and so on stay in effect after it
+//   source file
+// The script's parse is kept compiled on disk, see script_run(). An exit
+// in the script exits the shell.
+int shell_source(char **args)
+{
+    int result;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "smallsh: source: file name needed\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    result = script_run(args[1]);
+    if (result == -1) {
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    return result;
+}
+
+// Built in export command, sets environment variables for the shell and
+// every command it runs after
+//   export            list the environment
+//   export NAME=value ...
+// A NAME without a value is already exported if it is set, there are no
+// unexported shell variables.
+int shell_export(char **args)
+{
+    extern char **environ;
+    char *equals;
+    int i;
+
+    if (args[1] == NULL) {
+        for (i = 0; environ[i] != NULL; i++) {
+            printf("export %s\n", environ[i]);
+        }
+        fflush(stdout);
+        return 1;
+    }
+    for (i = 1; args[i] != NULL; i++) {
+        equals = strchr(args[i], '=');
+        if (equals == NULL) {
+            continue;
+        }
+        *equals = '\0';
+        if (equals == args[i] || setenv(args[i], equals + 1, 1) == -1) {
+            fprintf(stderr, "smallsh: export: %s: not a valid name\n", args[i]);
+            commandStatus = EXIT_FAILURE << 8;
+        } else {
+            env_changed(args[i]);
+        }
+        *equals = '=';
+    }
+    return 1;
+}
+
+// Built in unset command, removes environment variables
+//   unset NAME ...
+int shell_unset(char **args)
+{
+    int i;
+
+    for (i = 1; args[i] != NULL; i++) {
+        if (unsetenv(args[i]) == -1) {
+            fprintf(stderr, "smallsh: unset: %s: not a valid name\n", args[i]);
+            commandStatus = EXIT_FAILURE << 8;
+        } else {
+            env_changed(args[i]);
+        }
+    }
+    return 1;
+}
+
+// Closes the shell's end of the coprocess's stdin, so it sees end of
+// input. With all set the end reading its output is closed as well.
+void coproc_close(int all)
+{
+    if (coprocWrite != -1) {
+        close(coprocWrite);
+        coprocWrite = -1;
+        unsetenv("COPROC_WRITE");
+    }
+    if (all && coprocRead != -1) {
+        close(coprocRead);
+        coprocRead = -1;
+        unsetenv("COPROC_READ");
+        unsetenv("COPROC_PID");
+    }
+}
+
+// Built in coproc command, starts a background job connected to the
+// shell by a pipe each way
+//   coproc command [args...]   start it, replacing any earlier coprocess
+//   coproc -c                  close its stdin, so it sees end of input; its
+//                              output can still be read
+// The shell's ends are put in COPROC_WRITE (the command's stdin) and
+// COPROC_READ (its stdout), with its pid in COPROC_PID, for later
+// commands to use: echo request >&$COPROC_WRITE, read <&$COPROC_READ
+int shell_coproc(char **args)
+{
+    struct command *command;
+    char inFD[16], outFD[16], number[16];
+    int toChild[2], fromChild[2];
+    int i, job;
+
+    if (args[1] == NULL) {
+        fprintf(stderr, "smallsh: coproc: command needed\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    if (strcmp(args[1], "-c") == 0) {
+        coproc_close(0);
+        return 1;
+    }
+    // Waiting for it in the foreground would never finish
+    if (!backgroundAllowed) {
+        fprintf(stderr, "smallsh: coproc: not available in foreground-only mode\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    coproc_close(1);
+    if (pipe2(toChild, O_CLOEXEC) == -1) {
+        perror("smallsh: coproc");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    if (pipe2(fromChild, O_CLOEXEC) == -1) {
+        perror("smallsh: coproc");
+        close(toChild[0]);
+        close(toChild[1]);
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+
+    // Same as typing the command with <&in >&out &
+    command = command_new(&shellArena);
+    for (i = 1; args[i] != NULL; i++) {
+        command_add_arg(&shellArena, command, args[i]);
+    }
+    snprintf(inFD, sizeof(inFD), "%d", toChild[0]);
+    snprintf(outFD, sizeof(outFD), "%d", fromChild[1]);
+    command_add_redirection(&shellArena, command, 0, REDIR_DUP_IN, inFD);
+    command_add_redirection(&shellArena, command, 1, REDIR_DUP_OUT, outFD);
+    command->background = 1;
+
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    job = launch_job(command, 1, 1);
+    close(toChild[0]);
+    close(fromChild[1]);
+    if (job == -1) {
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        close(toChild[1]);
+        close(fromChild[0]);
+        commandStatus = status;
+        return 1;
+    }
+    lastBackgroundPid = jobTable[job].pgid;
+    jobCurrent = job;
+    printf("background pid is %d\n", lastBackgroundPid);
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+
+    coprocRead = fromChild[0];
+    coprocWrite = toChild[1];
+    snprintf(number, sizeof(number), "%d", coprocRead);
+    setenv("COPROC_READ", number, 1);
+    snprintf(number, sizeof(number), "%d", coprocWrite);
+    setenv("COPROC_WRITE", number, 1);
+    snprintf(number, sizeof(number), "%d", (int)lastBackgroundPid);
+    setenv("COPROC_PID", number, 1);
+    env_changed("COPROC_PID");
+    return 1;
+}
+
 // Built in status command, returns exit value of process,
 // or returns signal number if terminated by a signal.
 int shell_status(char ** args)
@@ -149,317 +1268,6245 @@ int shell_status(char ** args)
         printf("terminated by signal %d\n", WTERMSIG(status));
         fflush(stdout);
     }
+    // status -v also shows what the last foreground job used
+    if (args[1] != NULL && strcmp(args[1], "-v") == 0 && foregroundJobs > 0) {
+        usage_report(stdout, &lastUsage, lastWall);
+    }
     return 1;
 }
 
-// Loop for user input into shell
-void shell_loop(void)
+// Built in hash command, shows and manages the cache of command locations
+//   hash           list cached commands
+//   hash name...   look up commands and add them to the cache
+//   hash -r        forget all cached locations
+int shell_hash(char **args)
 {
-    char *line;
-    char **args;
-    // Flag that holds return value of executed commands,
-    // keeps loop running until 0 is returned from shell_execute function
-    int shell_active;  
+    int i;
+    struct path_entry *entry;
 
-    do {
-        // Reset flags for file redirection
-        in = 0;
-        out = 0;
-        // Check background processes
-        background_check(numBGProcesses, bgTracker);
+    // No arguments, list the cache
+    if (args[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (entry = pathCache[i]; entry != NULL; entry = entry->next) {
+                printf("%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        fflush(stdout);
+    }
+    // Clear the cache
+    else if (strcmp(args[1], "-r") == 0) {
+        path_cache_clear();
+    }
+    // Otherwise look up each name given, which fills the cache
+    else {
+        for (i = 1; args[i] != NULL; i++) {
+            if (strchr(args[i], '/') != NULL) {
+                continue;
+            }
+            if (path_lookup(args[i]) == NULL) {
+                fprintf(stderr, "smallsh: hash: %s: not found\n", args[i]);
+            }
+        }
+    }
+    return 1;
+}
 
-        printf(": ");
+// Built in set command, turns shell options on and off
+//   set                list options as set commands
+//   set -o name        turn option on
+//   set +o name        turn option off
+int shell_set(char **args)
+{
+    int i;
+
+    if (args[1] == NULL || (args[2] == NULL && strcmp(args[1], "-o") == 0)) {
+        for (i = 0; i < NUM_SHELL_OPTIONS; i++) {
+            printf("set %co %s\n", *shellOptions[i].flag ? '-' : '+', shellOptions[i].name);
+        }
         fflush(stdout);
-        line = shell_read_line(); // Handles and stores user input
-        args = shell_split_line(line); // Parses commands
-        shell_active = shell_execute(args);  // Executes commands
+        return 1;
+    }
 
-        free(line);
-        free(args);
-    } while (shell_active);
+    if ((strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0) || args[2] == NULL) {
+        fprintf(stderr, "smallsh: set: usage: set [-o|+o option]\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    for (i = 0; i < NUM_SHELL_OPTIONS; i++) {
+        if (strcmp(args[2], shellOptions[i].name) == 0) {
+            *shellOptions[i].flag = (args[1][0] == '-');
+            return 1;
+        }
+    }
+    fprintf(stderr, "smallsh: set: %s: invalid option name\n", args[2]);
+    commandStatus = EXIT_FAILURE << 8;
+    return 1;
+}
+
+// Built in shstat command, prints the shell's internal counters
+int shell_shstat(char **args)
+{
+    stats_report(stdout);
+    return 1;
 }
 
-// shell_read_line reads user input with getline()
-// Expands any occurence of $$ to the shell PID
-char *shell_read_line(void)
+// Adds a latency to a histogram and its total
+void stats_record(long *histogram, long *total, long ns)
 {
-    char *line = NULL;
-    size_t bufsize = 0; 
-    getline(&line, &bufsize, stdin);
+    long us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzl((unsigned long)us);
 
-    static char buffer[4096];
-    char *p = line;
+    histogram[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+    *total += ns;
+}
 
-    char pid[10];
-    snprintf(pid, 10, "%d", (int)getpid());
+// Prints the buckets of a histogram that have anything in them, as
+// name.le_Nus with the last one name.le_inf
+void stats_histogram(FILE *out, const char *name, const long *histogram, long totalNs)
+{
+    int i;
 
-    // Expanding $$ to parent PID
-    while((p=strstr(p, "$$"))){
-        strncpy(buffer, line, p-line);
-        buffer[p-line] = '\0';
-        strcat(buffer, pid);
-        strcat(buffer, p+strlen("$$"));
-        strcpy(line, buffer);
-        p++;
+    fprintf(out, "%s.total_us %ld\n", name, totalNs / 1000);
+    for (i = 0; i < STATS_BUCKETS; i++) {
+        if (histogram[i] == 0) {
+            continue;
+        }
+        if (i < STATS_BUCKETS - 1) {
+            fprintf(out, "%s.le_%ldus %ld\n", name, 1L << i, histogram[i]);
+        } else {
+            fprintf(out, "%s.le_inf %ld\n", name, histogram[i]);
+        }
     }
+}
 
-    return line;
+// Share of lookups that hit a cache, 0 before there are any
+double stats_rate(long hits, long misses)
+{
+    return hits + misses > 0 ? (double)hits / (hits + misses) : 0;
 }
 
-// shell_split_line() parses line from user using strtok
-// also handles logic for redirection and background commands
-#define TOK_BUFFSIZE 64
-#define TOK_DELIM " \t\r\n\a"
-char **shell_split_line(char *line)
+// Prints every counter, for shstat and SMALLSH_STATS
+void stats_report(FILE *out)
+{
+    fprintf(out, "commands.run %ld\n", shellStats.commands);
+    fprintf(out, "commands.builtin %ld\n", shellStats.builtins);
+    fprintf(out, "commands.external %ld\n", shellStats.externals);
+    fprintf(out, "launch.fork %ld\n", shellStats.forkLaunches);
+    fprintf(out, "launch.spawn %ld\n", shellStats.spawnLaunches);
+    fprintf(out, "pool.launches %ld\n", shellStats.poolLaunches);
+    stats_histogram(out, "launch", shellStats.launchHistogram, shellStats.launchNs);
+    stats_histogram(out, "wait", shellStats.waitHistogram, shellStats.waitNs);
+    fprintf(out, "fastcopy.taken %ld\n", shellStats.fastcopyTaken);
+    fprintf(out, "fastcopy.declined %ld\n", shellStats.fastcopyDeclined);
+    fprintf(out, "path.hits %ld\n", shellStats.pathHits);
+    fprintf(out, "path.misses %ld\n", shellStats.pathMisses);
+    fprintf(out, "path.hitrate %.3f\n", stats_rate(shellStats.pathHits, shellStats.pathMisses));
+    fprintf(out, "parse.hits %ld\n", shellStats.parseHits);
+    fprintf(out, "parse.misses %ld\n", shellStats.parseMisses);
+    fprintf(out, "parse.hitrate %.3f\n", stats_rate(shellStats.parseHits, shellStats.parseMisses));
+    fprintf(out, "parse.tokenspeak %ld\n", shellStats.tokensPeak);
+    fprintf(out, "glob.dirhits %ld\n", shellStats.globDirHits);
+    fprintf(out, "glob.dirreads %ld\n", shellStats.globDirReads);
+    fprintf(out, "script.hits %ld\n", shellStats.scriptHits);
+    fprintf(out, "script.compiled %ld\n", shellStats.scriptCompiled);
+    fprintf(out, "jobs.peak %ld\n", shellStats.jobsPeak);
+    fprintf(out, "arena.peak %zu\n", shellArena.peak);
+    fprintf(out, "event.backend %s\n", eventBackendNames[eventLoop.backend]);
+    fflush(out);
+}
+
+// Built in parallel command, runs a command once for each argument
+// after :::, keeping at most N of them running at a time
+//   parallel [-j N] command [args...] ::: arg...
+// Each run gets its argument in place of {}, or added at the end if
+// there is no {}. The next run starts as soon as one is reaped, and the
+// exit status of every run is reported in argument order. N defaults to
+// the number of CPUs the shell may run on. The exit value is the number
+// of runs that failed.
+int shell_parallel(char **args)
 {
-    int bufsize = TOK_BUFFSIZE, position = 0;
-    char **tokens = malloc(bufsize * sizeof(char*));
-    char *token;
-    // Reset isBackground flag
-    isBackground = 0;
+    struct command *command;
+    cpu_set_t cpus;
+    int maxJobs = 0, numTemplate = 0, numInputs, hasBraces = 0;
+    int started = 0, running = 0, reported = 0, failed = 0, interrupted = 0;
+    int i, j, *jobs, *results;
+    char **template, **inputs;
+    // Runs that fail to launch set status, which belongs to the last
+    // foreground command
+    int savedStatus = status;
 
-    if (!tokens) {
-        fprintf(stderr, "smallsh: allocation error for token buffer\n");
-        exit(EXIT_FAILURE);
+    args++;
+    if (*args != NULL && strcmp(*args, "-j") == 0) {
+        if (args[1] == NULL || (maxJobs = atoi(args[1])) <= 0) {
+            fprintf(stderr, "smallsh: parallel: -j needs a positive number\n");
+            commandStatus = EXIT_FAILURE << 8;
+            return 1;
+        }
+        args += 2;
+    }
+    if (maxJobs == 0) {
+        maxJobs = 1;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0 && CPU_COUNT(&cpus) > 0) {
+            maxJobs = CPU_COUNT(&cpus);
+        }
     }
 
-    // Get first argument
-    token = strtok(line, TOK_DELIM);
+    // Split into the command template and the inputs after :::
+    template = args;
+    while (template[numTemplate] != NULL && strcmp(template[numTemplate], ":::") != 0) {
+        if (strcmp(template[numTemplate], "{}") == 0) hasBraces = 1;
+        numTemplate++;
+    }
+    if (numTemplate == 0 || template[numTemplate] == NULL) {
+        fprintf(stderr, "smallsh: parallel: usage: parallel [-j N] command [args...] ::: arg...\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    inputs = &template[numTemplate + 1];
+    for (numInputs = 0; inputs[numInputs] != NULL; numInputs++);
 
-    // Get all successive arguments
-    while (token != NULL) {
+    jobs = arena_alloc(&shellArena, (numInputs + 1) * sizeof(int));
+    results = arena_alloc(&shellArena, (numInputs + 1) * sizeof(int));
 
-        // Resizes buffer if needed
-        if (position >= bufsize) {
-            bufsize += TOK_BUFFSIZE;
-            tokens = realloc(tokens, bufsize * sizeof(char*));
-            if (!tokens) {
-                fprintf(stderr, "smshell: allocation error\n");
-                exit(EXIT_FAILURE);
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    while (reported < numInputs) {
+        // Keep maxJobs runs in flight, unless a run was interrupted
+        while (running < maxJobs && started < numInputs && !interrupted) {
+            command = command_new(&shellArena);
+            for (j = 0; j < numTemplate; j++) {
+                command_add_arg(&shellArena, command,
+                        strcmp(template[j], "{}") == 0 ? inputs[started] : template[j]);
+            }
+            if (!hasBraces) {
+                command_add_arg(&shellArena, command, inputs[started]);
+            }
+            jobs[started] = launch_job(command, 0, 0);
+            if (jobs[started] == -1) {
+                results[started] = status;
+            } else {
+                running++;
             }
+            started++;
         }
-
-        // Logic to check for redirections and background commands
-
-        // Output redirection
-        if (strcmp(token, ">")==0){
-            // Set output flag 
-            out = 1;
-            // Grab the file name (should be next argument)
-            token = strtok(NULL,TOK_DELIM);
-            outputFile = token;
+        // Runs that were never started count as failed
+        if (interrupted && started < numInputs) {
+            for (; started < numInputs; started++) {
+                jobs[started] = -1;
+                results[started] = EXIT_FAILURE << 8;
+            }
         }
 
-        // Input redirection
-        else if (strcmp(token, "<")==0){
-            // Set input flag
-            in = 1;
-            // Grab input source, should be next argument
-            token = strtok(NULL,TOK_DELIM);
-            inputFile = token;
+        // Sleep until the SIGCHLD handler finishes a run
+        if (running > 0) {
+            sigsuspend(&childMask);
         }
-
-        // If not redirect or background, store argument in tokens array
-        // to be returned for execution
-        else {
-            tokens[position] = token;
-            position++;
+        for (i = reported; i < started; i++) {
+            if (jobs[i] != -1 && jobTable[jobs[i]].state == JOB_DONE) {
+                results[i] = jobTable[jobs[i]].status;
+                job_release(jobs[i]);
+                jobs[i] = -1;
+                running--;
+                if (WIFSIGNALED(results[i]) && WTERMSIG(results[i]) == SIGINT) {
+                    interrupted = 1;
+                }
+            }
         }
 
-        // Look at next argument
-        token = strtok(NULL, TOK_DELIM);
-    }
-
-    // Check for background command (&) is found at end of tokens array
-    // Position > 0 checks to make sure the tokens array isn't empty
-    if(position > 0 && strcmp(tokens[position-1], "&") ==0) {
-        // Remove & (by setting location in array to null)
-        // and set isBackground flag to 1
-        tokens[--position] = NULL;
-        // Only set isBackground if background mode is currently allowed
-        if(backgroundAllowed) {
-            isBackground = 1;
+        // Report finished runs in argument order
+        while (reported < started && jobs[reported] == -1) {
+            if (WIFEXITED(results[reported])) {
+                printf("parallel: %s: exit value %d\n", inputs[reported], WEXITSTATUS(results[reported]));
+            } else if (WIFSIGNALED(results[reported])) {
+                printf("parallel: %s: terminated by signal %d\n", inputs[reported], WTERMSIG(results[reported]));
+            }
+            if (results[reported] != 0) {
+                failed++;
+            }
+            reported++;
         }
+        fflush(stdout);
     }
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
 
-    else {
-        // Set last argument in array to NULL, required for execvp()
-        tokens[position] = NULL;
-    }
-    
-    return tokens;
+    status = savedStatus;
+    commandStatus = (failed > 255 ? 255 : failed) << 8;
+    return 1;
 }
 
-/* Function to handle execution of built in commands, comments, and blank lines */
-int shell_execute(char **args)
+// Built in pool command, shows or sets the number of pre-forked workers
+//   pool        show the pool size and idle workers
+//   pool N      keep N workers ready, 0 turns the pool off
+int shell_pool(char **args)
 {
-    // A comment or emtpy line was entered.
-    if (args[0] == NULL || strchr(args[0], '#') != NULL) {
+    int size;
+
+    if (args[1] == NULL) {
+        printf("pool size %d, %d idle\n", poolSize, poolIdle);
+        fflush(stdout);
         return 1;
     }
-
-    int i;
-    int num_builtins = shell_num_builtins();
-    // Searches for built in commands
-    for (i = 0; i < num_builtins; i++) {
-        if (strcmp(args[0], builtin_str[i]) == 0) {
-            // If built in, pass arguments to function pointer for that command
-            return (*builtin_func[i])(args);
+    size = atoi(args[1]);
+    if (size < 0 || (size == 0 && strcmp(args[1], "0") != 0)) {
+        fprintf(stderr, "smallsh: pool: usage: pool [size]\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    pool_resize(size);
+    pool_refill();
+    return 1;
+}
+
+// Built in jobs command, lists jobs that are in the background or stopped
+//   jobs [-v]
+// With -v, jobs in cgroups (set -o cgroups) also show what the whole job
+// is using: memory.current, cpu.stat and io.stat summed over devices.
+int shell_jobs(char **args)
+{
+    int index;
+    int verbose = args[1] != NULL && strcmp(args[1], "-v") == 0;
+
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    for (index = 0; index < jobCapacity; index++) {
+        struct job *job = &jobTable[index];
+        if (job->state == JOB_FREE || !job->background) {
+            continue;
+        }
+        printf("[%d]%c %-8s ", index + 1, index == jobCurrent ? '+' : ' ',
+                job->state == JOB_DONE ? "Done" : job->state == JOB_STOPPED ? "Stopped" : "Running");
+        if (job->remoteHost != -1) {
+            printf("%s\t%s\n", remoteHosts[job->remoteHost].name, job->command);
+        } else {
+            printf("%d\t%s\n", (int)job->pgid, job->command);
+        }
+        if (verbose && job->cgroupFD != -1) {
+            cgroup_report(job);
+        }
+    }
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+    return 1;
+}
+
+// Built in fg command, brings a background or stopped job to the
+// foreground and waits for it
+//   fg [%n | pid]
+int shell_fg(char **args)
+{
+    int index;
+
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    index = job_parse_spec(args[1], "fg");
+    if (index != -1 && jobTable[index].state == JOB_DONE) {
+        // Finished already, it is reported at the next prompt
+        fprintf(stderr, "smallsh: fg: job has terminated\n");
+        index = -1;
+    }
+    if (index != -1) {
+        printf("%s\n", jobTable[index].command);
+        fflush(stdout);
+        job_continue(index, 0);
+        foreground_wait(index);
+        if (WIFSIGNALED(status)) {
+            printf("terminated by signal %d\n", WTERMSIG(status));
+            fflush(stdout);
+        }
+        commandStatus = status;
+    } else {
+        commandStatus = EXIT_FAILURE << 8;
+    }
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+    return 1;
+}
+
+// Built in bg command, lets a stopped job carry on in the background
+//   bg [%n | pid]
+int shell_bg(char **args)
+{
+    int index;
+
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    index = job_parse_spec(args[1], "bg");
+    if (index != -1 && jobTable[index].state != JOB_STOPPED) {
+        fprintf(stderr, "smallsh: bg: job %d is not stopped\n", index + 1);
+        index = -1;
+    }
+    if (index != -1) {
+        job_continue(index, 1);
+        jobCurrent = index;
+        printf("[%d] %s &\n", index + 1, jobTable[index].command);
+        fflush(stdout);
+    }
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+    return 1;
+}
+
+// Built in wait command, sleeps until background jobs finish instead
+// of polling for them
+//   wait              every background job
+//   wait %n | pid...  just those, status is that of the last one
+// Jobs that are stopped aren't waited for. SIGINT gives up waiting.
+// Finished jobs are still reported at the next prompt as usual.
+int shell_wait(char **args)
+{
+    struct sigaction waitAction = {0}, oldAction;
+    int i, index, waiting;
+
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    // Background jobs ignore SIGINT, so without this it couldn't be stopped
+    shellInterrupted = 0;
+    waitAction.sa_handler = catchShellSIGINT;
+    sigaction(SIGINT, &waitAction, &oldAction);
+
+    if (args[1] == NULL) {
+        do {
+            waiting = 0;
+            for (index = jobLive; index != -1; index = jobTable[index].next) {
+                if (jobTable[index].background && jobTable[index].state == JOB_RUNNING) {
+                    waiting = 1;
+                }
+            }
+            if (waiting) {
+                shell_suspend();
+            }
+        } while (waiting && !shellInterrupted);
+        status = 0;
+    }
+    for (i = 1; args[1] != NULL && args[i] != NULL && !shellInterrupted; i++) {
+        index = job_parse_spec(args[i], "wait");
+        if (index == -1) {
+            status = 127 << 8;
+            continue;
+        }
+        while (jobTable[index].state == JOB_RUNNING && !shellInterrupted) {
+            shell_suspend();
+        }
+        if (jobTable[index].state == JOB_DONE) {
+            status = jobTable[index].status;
+        } else if (jobTable[index].state == JOB_STOPPED) {
+            status = (128 + jobTable[index].stopSignal) << 8;
+        }
+    }
+
+    sigaction(SIGINT, &oldAction, NULL);
+    if (shellInterrupted) {
+        status = (128 + SIGINT) << 8;
+    }
+    commandStatus = status;
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+    return 1;
+}
+
+// Loop for user input into shell
+void shell_loop(void)
+{
+    char *line;
+    struct command *command;
+    // Flag that holds return value of executed commands,
+    // keeps loop running until 0 is returned from shell_execute function
+    int shell_active = 1;
+
+    do {
+        // Report background processes that finished
+        background_check();
+        // Fork replacement pool workers while waiting for input
+        pool_refill();
+
+        // Everything printed to stdout is flushed right away, so the
+        // prompt can skip stdio
+        if (interactive) {
+            write(STDOUT_FILENO, ": ", 2);
+        }
+        line = input_next_line(); // Handles and stores user input
+        if (line == NULL) {
+            // End of input, leave the same way exit does
+            if (interactive) {
+                printf("\n");
+                fflush(stdout);
+            }
+            shell_exit(NULL);
+            break;
+        }
+        // The line is parsed in place, and would be moved by reading
+        // heredoc bodies into the input buffer after it
+        if (strstr(line, "<<") != NULL) {
+            char *copy = arena_alloc(&shellArena, strlen(line) + 1);
+            line = strcpy(copy, line);
+        }
+        // Parses and executes commands
+        if (shell_parse_input(line, &command) == 0 && command != NULL
+                && heredoc_collect(command, input_body_line, NULL) == 0) {
+            shell_active = shell_execute_list(command);
+        }
+
+        // Release the parsed command and its expansions in one go
+        arena_reset(&shellArena);
+    } while (shell_active);
+}
+
+// Hands out size bytes from an arena, 16 byte aligned
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = arena->current;
+    size_t start;
+
+    size = (size + 15) & ~(size_t)15;
+    if (chunk != NULL) {
+        start = (chunk->used + 15) & ~(size_t)15;
+        if (start + size <= chunk->size) {
+            chunk->used = start + size;
+            arena->inUse += size;
+            if (arena->inUse > arena->peak) arena->peak = arena->inUse;
+            return chunk->data + start;
+        }
+    }
+
+    // Current chunk is full, move on to the next kept chunk if it is big
+    // enough, otherwise add a new one after the current chunk
+    if (chunk != NULL && chunk->next != NULL && chunk->next->size >= size) {
+        chunk = chunk->next;
+    } else {
+        struct arena_chunk *fresh;
+        size_t chunkSize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        fresh = malloc(sizeof(struct arena_chunk) + chunkSize);
+        if (!fresh) {
+            fprintf(stderr, "smallsh: allocation error for command arena\n");
+            exit(EXIT_FAILURE);
+        }
+        fresh->size = chunkSize;
+        fresh->used = 0;
+        if (chunk == NULL) {
+            fresh->next = NULL;
+            arena->first = fresh;
+        } else {
+            fresh->next = chunk->next;
+            chunk->next = fresh;
+        }
+        chunk = fresh;
+    }
+    arena->current = chunk;
+    chunk->used = size;
+    arena->inUse += size;
+    if (arena->inUse > arena->peak) arena->peak = arena->inUse;
+    return chunk->data;
+}
+
+// Resizes an arena allocation. The most recent allocation grows in place
+// when its chunk has room, anything else is copied to a new allocation.
+void *arena_grow(struct arena *arena, void *ptr, size_t oldSize, size_t newSize)
+{
+    struct arena_chunk *chunk = arena->current;
+    void *fresh;
+
+    if (ptr != NULL && chunk != NULL) {
+        size_t start = (char *)ptr - chunk->data;
+        size_t end = (start + oldSize + 15) & ~(size_t)15;
+        if ((char *)ptr >= chunk->data && end == chunk->used && start + newSize <= chunk->size) {
+            size_t newEnd = (start + newSize + 15) & ~(size_t)15;
+            if (newEnd > chunk->size) newEnd = chunk->size;
+            arena->inUse += newEnd - end;
+            if (arena->inUse > arena->peak) arena->peak = arena->inUse;
+            chunk->used = newEnd;
+            return ptr;
+        }
+    }
+
+    fresh = arena_alloc(arena, newSize);
+    if (ptr != NULL) {
+        memcpy(fresh, ptr, oldSize < newSize ? oldSize : newSize);
+    }
+    return fresh;
+}
+
+// Releases everything allocated from an arena
+void arena_reset(struct arena *arena)
+{
+    struct arena_chunk *chunk;
+
+    for (chunk = arena->first; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->first;
+    arena->inUse = 0;
+}
+
+// Frees all of an arena's chunks, for arenas that aren't used again
+void arena_free(struct arena *arena)
+{
+    struct arena_chunk *chunk, *next;
+
+    for (chunk = arena->first; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->first = arena->current = NULL;
+    arena->inUse = 0;
+}
+
+// Sets up reading commands from stdin. The prompt isn't printed for
+// stdin that isn't a terminal. Scripts are run by script_run() instead.
+void input_open(void)
+{
+    shellInput.fd = STDIN_FILENO;
+    interactive = isatty(STDIN_FILENO);
+
+    shellInput.size = INPUT_BUFFSIZE;
+    shellInput.buffer = malloc(shellInput.size);
+    if (!shellInput.buffer) {
+        fprintf(stderr, "smallsh: allocation error for input buffer\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Returns the next line of input, without its newline, or NULL at the
+// end of input. The line points into the input buffer and stays valid
+// until the next call.
+char *input_next_line(void)
+{
+    struct shell_input *input = &shellInput;
+    char *line, *newline;
+    ssize_t count;
+
+    for (;;) {
+        // Hand out a complete line if one is buffered
+        line = input->buffer + input->start;
+        newline = memchr(line, '\n', input->end - input->start);
+        if (newline != NULL) {
+            *newline = '\0';
+            input->start = newline + 1 - input->buffer;
+            return line;
+        }
+
+        // Last line without a newline at the end of input
+        if (input->eof) {
+            if (input->start == input->end) {
+                return NULL;
+            }
+            input->buffer[input->end] = '\0';
+            input->start = input->end;
+            return line;
+        }
+
+        // Move the partial line to the front, and grow the buffer if the
+        // line fills all of it (one byte is kept free for the final NUL)
+        if (input->start > 0) {
+            memmove(input->buffer, line, input->end - input->start);
+            input->end -= input->start;
+            input->start = 0;
+        }
+        if (input->end + 1 >= input->size) {
+            input->size *= 2;
+            input->buffer = realloc(input->buffer, input->size);
+            if (!input->buffer) {
+                fprintf(stderr, "smallsh: allocation error for input buffer\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Wait in the event loop, so finished jobs are reported meanwhile
+        if (eventLoop.backend != EVENT_NONE && input->fd == STDIN_FILENO) {
+            event_wait_input();
+        }
+        count = read(input->fd, input->buffer + input->end, input->size - input->end - 1);
+        if (count > 0) {
+            input->end += count;
+        } else if (count == 0 || errno != EINTR) {
+            input->eof = 1;
+        }
+    }
+}
+
+// Hands out heredoc body lines read from stdin, with a "> " prompt for
+// each one at a terminal
+char *input_body_line(void *unused)
+{
+    if (interactive) {
+        write(STDOUT_FILENO, "> ", 2);
+    }
+    return input_next_line();
+}
+
+// Makes room for at least extra more bytes at position used in the
+// expansion buffer, which lives in the command arena
+void expand_reserve(char **buffer, size_t *size, size_t used, size_t extra)
+{
+    size_t newSize = *size;
+
+    if (used + extra <= *size) {
+        return;
+    }
+    while (used + extra > newSize) {
+        newSize = newSize ? newSize * 2 : 256;
+    }
+    *buffer = arena_grow(&shellArena, *buffer, *size, newSize);
+    *size = newSize;
+}
+
+// Expands $ parameters in a single pass over the line:
+//   $$           the shell's PID
+//   $?           exit value of the last command run, builtins included
+//   $!           PID of the last background command
+//   $NAME ${NAME} value of environment variable NAME, empty if unset
+// Anything else after a $ is left as it is. Returns the line itself if
+// there is nothing to expand, otherwise the expansion in the arena.
+char *shell_expand(char *line)
+{
+    const char *p, *name, *value;
+    char number[16];
+    char *expandBuffer = NULL;
+    size_t expandSize = 0, used = 0, length, nameLength;
+
+    // Nothing to expand, use the line in place
+    if (line == NULL || strchr(line, '$') == NULL) {
+        return line;
+    }
+
+    expand_reserve(&expandBuffer, &expandSize, 0, strlen(line) + 1);
+    for (p = line; *p != '\0'; ) {
+        // Copy the plain text up to the next $ in one go
+        if (*p != '$') {
+            length = strcspn(p, "$");
+            expand_reserve(&expandBuffer, &expandSize, used, length + 1);
+            memcpy(expandBuffer + used, p, length);
+            used += length;
+            p += length;
+            continue;
+        }
+
+        value = NULL;
+        if (p[1] == '$') {
+            value = shellPid;
+            p += 2;
+        } else if (p[1] == '?') {
+            // Not status, that is only set by foreground processes
+            snprintf(number, sizeof(number), "%d", WIFSIGNALED(commandStatus)
+                    ? 128 + WTERMSIG(commandStatus) : WEXITSTATUS(commandStatus));
+            value = number;
+            p += 2;
+        } else if (p[1] == '!') {
+            snprintf(number, sizeof(number), "%d", (int)lastBackgroundPid);
+            value = lastBackgroundPid ? number : "";
+            p += 2;
+        } else {
+            // Variable name, either bare or in braces
+            int braces = (p[1] == '{');
+            name = p + 1 + braces;
+            nameLength = 0;
+            if (*name == '_' || (*name >= 'A' && *name <= 'Z') || (*name >= 'a' && *name <= 'z')) {
+                while (name[nameLength] == '_' || (name[nameLength] >= 'A' && name[nameLength] <= 'Z')
+                        || (name[nameLength] >= 'a' && name[nameLength] <= 'z')
+                        || (name[nameLength] >= '0' && name[nameLength] <= '9')) {
+                    nameLength++;
+                }
+            }
+            if (nameLength > 0 && (!braces || name[nameLength] == '}')) {
+                char saved = name[nameLength];
+                // Look the name up in place, the line is ours to modify
+                ((char *)name)[nameLength] = '\0';
+                value = getenv(name);
+                ((char *)name)[nameLength] = saved;
+                if (value == NULL) {
+                    value = "";
+                }
+                p = name + nameLength + braces;
+            }
+        }
+
+        // Not something that expands, keep the $
+        if (value == NULL) {
+            expand_reserve(&expandBuffer, &expandSize, used, 2);
+            expandBuffer[used++] = *p++;
+            continue;
+        }
+        length = strlen(value);
+        expand_reserve(&expandBuffer, &expandSize, used, length + 1);
+        memcpy(expandBuffer + used, value, length);
+        used += length;
+    }
+    expandBuffer[used] = '\0';
+
+    return expandBuffer;
+}
+
+// Tokenizer settings: initial argument list size and word separators
+#define TOK_BUFFSIZE 64
+#define TOK_DELIM " \t\r\n\a"
+
+// Looks at the character the scanner is on. The first character after a
+// word may have been overwritten by the NUL ending that word, in which
+// case it is kept in held.
+char scan_peek(struct scanner *scanner)
+{
+    return scanner->held ? scanner->held : *scanner->p;
+}
+
+// Moves the scanner past the character it is on
+void scan_advance(struct scanner *scanner)
+{
+    scanner->held = 0;
+    scanner->p++;
+}
+
+// Returns 1 for characters that end a word without needing a space
+int scan_is_operator(char c)
+{
+    return c == '|' || c == '&' || c == '<' || c == '>' || c == ';';
+}
+
+// Reentrant tokenizer, splits the line into words and operators in
+// place (words are NUL terminated inside the line, like strtok_r).
+// All scanning state is kept in the scanner, so lines can be tokenized
+// independently of each other. Redirection operators may start with a
+// descriptor number, like 2> or 0<.
+void scan_next(struct scanner *scanner, struct token *token)
+{
+    char c;
+    char *start;
+
+    // Skip whitespace between tokens
+    while ((c = scan_peek(scanner)) != '\0' && strchr(TOK_DELIM, c) != NULL) {
+        scan_advance(scanner);
+    }
+
+    token->text = NULL;
+    token->ioNumber = -1;
+    // A word starting with # comments out the rest of the line, operators
+    // in it included. The scanner stays on it, so it stays the end.
+    if (c == '\0' || c == '#') {
+        token->type = TOK_END;
+        return;
+    }
+
+    // Operators
+    if (c == '|') {
+        scan_advance(scanner);
+        token->type = TOK_PIPE;
+        if (scan_peek(scanner) == '|') {
+            scan_advance(scanner);
+            token->type = TOK_OR;
+        }
+        return;
+    }
+    if (c == '&') {
+        scan_advance(scanner);
+        token->type = TOK_AMP;
+        if (scan_peek(scanner) == '&') {
+            scan_advance(scanner);
+            token->type = TOK_AND;
+        }
+        return;
+    }
+    if (c == ';') {
+        scan_advance(scanner);
+        token->type = TOK_SEMI;
+        return;
+    }
+    if (c == '<' || c == '>') {
+        scan_advance(scanner);
+        token->type = (c == '<') ? TOK_LESS : TOK_GREAT;
+        if (c == '>' && scan_peek(scanner) == '>') {
+            scan_advance(scanner);
+            token->type = TOK_DGREAT;
+        } else if (c == '<' && scan_peek(scanner) == '<') {
+            scan_advance(scanner);
+            token->type = TOK_DLESS;
+            if (scan_peek(scanner) == '<') {
+                scan_advance(scanner);
+                token->type = TOK_TLESS;
+            }
+        } else if (scan_peek(scanner) == '&') {
+            scan_advance(scanner);
+            token->type = (c == '<') ? TOK_LESSAND : TOK_GREATAND;
+        }
+        return;
+    }
+
+    // A word runs until whitespace or an operator. If the held character
+    // started it, the word begins at the NUL and needs that put back.
+    if (scanner->held) {
+        *scanner->p = scanner->held;
+        scanner->held = 0;
+    }
+    start = scanner->p;
+    while (*scanner->p != '\0' && strchr(TOK_DELIM, *scanner->p) == NULL
+            && !scan_is_operator(*scanner->p)) {
+        scanner->p++;
+    }
+
+    // All digits right before < or > is the descriptor to redirect
+    if (*scanner->p == '<' || *scanner->p == '>') {
+        char *d = start;
+        while (d < scanner->p && *d >= '0' && *d <= '9') d++;
+        if (d == scanner->p && scanner->p - start <= 4) {
+            scan_next(scanner, token);
+            if (token->type == TOK_LESS || token->type == TOK_GREAT || token->type == TOK_DGREAT
+                    || token->type == TOK_LESSAND || token->type == TOK_GREATAND
+                    || token->type == TOK_DLESS || token->type == TOK_TLESS) {
+                token->ioNumber = atoi(start);
+            }
+            return;
+        }
+    }
+
+    // End the word, keeping whatever comes after it for the next call
+    token->type = TOK_WORD;
+    token->text = start;
+    if (*scanner->p != '\0') {
+        scanner->held = *scanner->p;
+        *scanner->p = '\0';
+    }
+}
+
+// Adds an argument to a command, growing argv in the arena as needed
+void command_add_arg(struct arena *arena, struct command *command, char *arg)
+{
+    if (command->argc + 1 >= command->argvSize) {
+        int newSize = command->argvSize ? command->argvSize * 2 : TOK_BUFFSIZE;
+        command->argv = arena_grow(arena, command->argv,
+                command->argvSize * sizeof(char *), newSize * sizeof(char *));
+        command->argvSize = newSize;
+    }
+    command->argv[command->argc++] = arg;
+    // Keep the list NULL terminated, required for exec
+    command->argv[command->argc] = NULL;
+}
+
+// Adds a redirection to a command
+void command_add_redirection(struct arena *arena, struct command *command,
+        int fd, int type, char *target)
+{
+    struct redirection *redir;
+
+    command->redirs = arena_grow(arena, command->redirs,
+            command->numRedirs * sizeof(struct redirection),
+            (command->numRedirs + 1) * sizeof(struct redirection));
+    redir = &command->redirs[command->numRedirs++];
+    redir->fd = fd;
+    redir->type = type;
+    redir->target = target;
+}
+
+// Starts a new, empty command (one stage of a pipeline)
+struct command *command_new(struct arena *arena)
+{
+    struct command *command = arena_alloc(arena, sizeof(struct command));
+
+    memset(command, 0, sizeof(struct command));
+    command->argvSize = TOK_BUFFSIZE;
+    command->argv = arena_alloc(arena, TOK_BUFFSIZE * sizeof(char *));
+    command->argv[0] = NULL;
+    return command;
+}
+
+// shell_parse_line() parses a line into a command, allocated from the
+// given arena. Each stage of a pipeline is a command linked through next,
+// with its own argv and redirections; the first stage carries the
+// background flag. Pipelines separated by ; && || are linked through the
+// first stage's nextInList, with connector saying how. The line is
+// modified in place.
+// Returns 0 and sets *result (NULL for a blank line), or -1 after
+// printing a message for a syntax error.
+int shell_parse_line(struct arena *arena, char *line, struct command **result)
+{
+    static const char *connectorText[] = { "", ";", "&&", "||" };
+    struct scanner scanner = { line, 0 };
+    struct token token;
+    struct command *list = command_new(arena);
+    struct command *head = list;      // First stage of the current pipeline
+    struct command *previous = NULL;  // First stage of the pipeline before it
+    struct command *current = head;
+    int type, tokens = 0;
+
+    *result = NULL;
+    scan_next(&scanner, &token);
+    while (token.type != TOK_END) {
+        tokens++;
+        switch (token.type) {
+        case TOK_WORD:
+            command_add_arg(arena, current, token.text);
+            break;
+
+        // Logic to check for redirections, the file name is the next word
+        case TOK_LESS:
+        case TOK_GREAT:
+        case TOK_DGREAT:
+        case TOK_LESSAND:
+        case TOK_GREATAND:
+        case TOK_DLESS:
+        case TOK_TLESS:
+            type = token.type == TOK_LESS ? REDIR_IN
+                 : token.type == TOK_GREAT ? REDIR_OUT
+                 : token.type == TOK_DGREAT ? REDIR_APPEND
+                 : token.type == TOK_LESSAND ? REDIR_DUP_IN
+                 : token.type == TOK_GREATAND ? REDIR_DUP_OUT
+                 : token.type == TOK_DLESS ? REDIR_HEREDOC : REDIR_HERESTRING;
+            if (token.ioNumber == -1) {
+                token.ioNumber = (type == REDIR_OUT || type == REDIR_APPEND || type == REDIR_DUP_OUT) ? 1 : 0;
+            }
+            int fd = token.ioNumber;
+            scan_next(&scanner, &token);
+            if (token.type != TOK_WORD) {
+                fprintf(stderr, "smallsh: syntax error: missing file name for redirection\n");
+                return -1;
+            }
+            // Copying a descriptor needs its number, one from a $ parameter
+            // is checked once it is expanded
+            if ((type == REDIR_DUP_IN || type == REDIR_DUP_OUT) && strchr(token.text, '$') == NULL
+                    && (token.text[strspn(token.text, "0123456789")] != '\0' || strlen(token.text) > 4)) {
+                fprintf(stderr, "smallsh: syntax error: `%s' needs a descriptor number\n",
+                        type == REDIR_DUP_IN ? "<&" : ">&");
+                return -1;
+            }
+            command_add_redirection(arena, current, fd, type, token.text);
+            break;
+
+        // Start the next pipeline stage
+        case TOK_PIPE:
+            if (current->argc == 0) {
+                fprintf(stderr, "smallsh: syntax error near unexpected token `|'\n");
+                return -1;
+            }
+            current->next = command_new(arena);
+            current = current->next;
+            break;
+
+        // End the pipeline, the next one starts a new item of the list
+        case TOK_SEMI:
+        case TOK_AND:
+        case TOK_OR:
+            type = token.type == TOK_SEMI ? LIST_SEQ : token.type == TOK_AND ? LIST_AND : LIST_OR;
+            if (current->argc == 0) {
+                fprintf(stderr, "smallsh: syntax error near unexpected token `%s'\n", connectorText[type]);
+                return -1;
+            }
+            head->connector = type;
+            head->nextInList = command_new(arena);
+            previous = head;
+            head = current = head->nextInList;
+            break;
+
+        // & at the end makes a background command, anywhere else it
+        // is just an argument
+        case TOK_AMP:
+            scan_next(&scanner, &token);
+            if (token.type == TOK_END) {
+                head->background = 1;
+                continue;
+            }
+            command_add_arg(arena, current, "&");
+            continue;
+        }
+        scan_next(&scanner, &token);
+    }
+    if (tokens > shellStats.tokensPeak) {
+        shellStats.tokensPeak = tokens;
+    }
+
+    if (current->argc == 0) {
+        if (current != head) {
+            fprintf(stderr, "smallsh: syntax error near unexpected token `|'\n");
+            return -1;
+        }
+        // A line can end with ; but not with && or ||
+        if (previous != NULL) {
+            if (previous->connector != LIST_SEQ) {
+                fprintf(stderr, "smallsh: syntax error: unexpected end of line after `%s'\n",
+                        connectorText[previous->connector]);
+                return -1;
+            }
+            previous->connector = LIST_END;
+            previous->nextInList = NULL;
+            *result = list;
+            return 0;
+        }
+        // Blank line (or only redirections), nothing to run
+        return 0;
+    }
+    *result = list;
+    return 0;
+}
+
+// Adds an expanded word to a command, split at whitespace into as many
+// arguments as it holds. The word is split in place, one that expanded
+// to nothing adds none.
+void expand_split_word(struct arena *arena, struct command *command, char *word)
+{
+    char *end, *next;
+
+    word += strspn(word, TOK_DELIM);
+    while (*word != '\0') {
+        end = word + strcspn(word, TOK_DELIM);
+        next = (*end != '\0') ? end + 1 : end;
+        *end = '\0';
+        command_add_arg(arena, command, word);
+        word = next + strspn(next, TOK_DELIM);
+    }
+}
+
+// Expands the $ parameters in the words of one pipeline, in place. The
+// line was split into words and operators before, so whatever a value
+// holds (; | > # and so on) is only ever text. Arguments are split at
+// whitespace after expanding like other shells do, redirection targets
+// are kept whole and heredoc delimiters (or bodies) are left alone.
+// Returns -1 after printing a message if the pipeline can't be run.
+int shell_expand_pipeline(struct command *pipeline)
+{
+    struct command *stage;
+    struct redirection *redir;
+    char **words;
+    int i, numWords, dollar;
+
+    for (stage = pipeline; stage != NULL; stage = stage->next) {
+        for (i = 0; i < stage->numRedirs; i++) {
+            redir = &stage->redirs[i];
+            if (redir->type == REDIR_HEREDOC || strchr(redir->target, '$') == NULL) {
+                continue;
+            }
+            redir->target = shell_expand(redir->target);
+            if ((redir->type == REDIR_DUP_IN || redir->type == REDIR_DUP_OUT)
+                    && (redir->target[0] == '\0' || strlen(redir->target) > 4
+                    || redir->target[strspn(redir->target, "0123456789")] != '\0')) {
+                fprintf(stderr, "smallsh: `%s' needs a descriptor number, not `%s'\n",
+                        redir->type == REDIR_DUP_IN ? "<&" : ">&", redir->target);
+                return -1;
+            }
+        }
+
+        for (i = 0, dollar = 0; i < stage->argc && !dollar; i++) {
+            dollar = (strchr(stage->argv[i], '$') != NULL);
+        }
+        if (!dollar) {
+            continue;
+        }
+        // Build argv again, expanded words go straight into it
+        words = stage->argv;
+        numWords = stage->argc;
+        stage->argv = NULL;
+        stage->argc = stage->argvSize = 0;
+        for (i = 0; i < numWords; i++) {
+            if (strchr(words[i], '$') == NULL) {
+                command_add_arg(&shellArena, stage, words[i]);
+            } else {
+                expand_split_word(&shellArena, stage, shell_expand(words[i]));
+            }
+        }
+        if (stage->argc == 0) {
+            // Everything expanded to nothing. Alone that runs nothing, in
+            // a pipeline it leaves a stage without a program.
+            if (stage != pipeline || stage->next != NULL) {
+                fprintf(stderr, "smallsh: empty command in pipeline\n");
+                return -1;
+            }
+            stage->argv = words;
+            stage->argv[0] = NULL;
+        }
+    }
+    return 0;
+}
+
+// FNV-1a hash of a raw line for the parse cache
+unsigned long long parse_cache_hash(const char *line)
+{
+    unsigned long long hash = 14695981039346656037ull;
+
+    while (*line != '\0') {
+        hash ^= (unsigned char)*line++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Flattens a parsed command list into one malloc()ed block, laid out as
+//   int numCommands
+//   struct flat_command commands[numCommands]   stages in list order
+//   size_t argOffsets[]                         every stage's argv
+//   struct flat_redirection redirs[]
+//   char strings[]                              arguments and file names
+// Everything refers to the rest of the block by index or offset, so it
+// can be copied anywhere.
+char *parse_cache_flatten(struct command *list, size_t *blobSize)
+{
+    struct command *item, *stage;
+    struct flat_command *flat;
+    struct flat_redirection *redirs;
+    size_t *argOffsets;
+    size_t size, stringsSize = 0, used;
+    int numCommands = 0, numArgs = 0, numRedirs = 0;
+    int c = 0, a = 0, r = 0, i;
+    char *blob, *strings;
+
+    for (item = list; item != NULL; item = item->nextInList) {
+        for (stage = item; stage != NULL; stage = stage->next) {
+            numCommands++;
+            numArgs += stage->argc;
+            numRedirs += stage->numRedirs;
+            for (i = 0; i < stage->argc; i++) {
+                stringsSize += strlen(stage->argv[i]) + 1;
+            }
+            for (i = 0; i < stage->numRedirs; i++) {
+                stringsSize += strlen(stage->redirs[i].target) + 1;
+            }
+        }
+    }
+
+    size = sizeof(size_t) + numCommands * sizeof(struct flat_command)
+         + numArgs * sizeof(size_t) + numRedirs * sizeof(struct flat_redirection)
+         + stringsSize;
+    blob = malloc(size);
+    if (!blob) {
+        fprintf(stderr, "smallsh: allocation error for parse cache\n");
+        exit(EXIT_FAILURE);
+    }
+    *(int *)blob = numCommands;
+    flat = (struct flat_command *)(blob + sizeof(size_t));
+    argOffsets = (size_t *)(flat + numCommands);
+    redirs = (struct flat_redirection *)(argOffsets + numArgs);
+    strings = (char *)(redirs + numRedirs);
+    used = strings - blob;
+
+    for (item = list; item != NULL; item = item->nextInList) {
+        for (stage = item; stage != NULL; stage = stage->next, c++) {
+            flat[c].argc = stage->argc;
+            flat[c].firstArg = a;
+            flat[c].numRedirs = stage->numRedirs;
+            flat[c].firstRedir = r;
+            flat[c].background = stage->background;
+            flat[c].connector = stage->connector;
+            flat[c].next = stage->next != NULL ? c + 1 : -1;
+            flat[c].nextInList = -1;
+            for (i = 0; i < stage->argc; i++, a++) {
+                argOffsets[a] = used;
+                strcpy(blob + used, stage->argv[i]);
+                used += strlen(stage->argv[i]) + 1;
+            }
+            for (i = 0; i < stage->numRedirs; i++, r++) {
+                redirs[r].fd = stage->redirs[i].fd;
+                redirs[r].type = stage->redirs[i].type;
+                redirs[r].target = used;
+                strcpy(blob + used, stage->redirs[i].target);
+                used += strlen(stage->redirs[i].target) + 1;
+            }
+        }
+        // The list continues after the last stage of this pipeline
+        if (item->nextInList != NULL) {
+            for (i = c - 1; i > 0 && flat[i - 1].next == i; i--);
+            flat[i].nextInList = c;
+        }
+    }
+    *blobSize = size;
+    return blob;
+}
+
+// Rebuilds a command list from a flattened block, copying it into the
+// arena so the cache entry can be evicted while the commands run
+struct command *parse_cache_inflate(struct arena *arena, const char *cached, size_t blobSize)
+{
+    char *blob = arena_alloc(arena, blobSize);
+    int numCommands, c, i;
+    struct flat_command *flat;
+    struct flat_redirection *redirs;
+    size_t *argOffsets;
+    struct command *commands;
+    int numArgs = 0;
+
+    memcpy(blob, cached, blobSize);
+    numCommands = *(int *)blob;
+    flat = (struct flat_command *)(blob + sizeof(size_t));
+    for (c = 0; c < numCommands; c++) {
+        numArgs += flat[c].argc;
+    }
+    argOffsets = (size_t *)(flat + numCommands);
+    redirs = (struct flat_redirection *)(argOffsets + numArgs);
+
+    commands = arena_alloc(arena, numCommands * sizeof(struct command));
+    memset(commands, 0, numCommands * sizeof(struct command));
+    for (c = 0; c < numCommands; c++) {
+        struct command *command = &commands[c];
+        command->argc = flat[c].argc;
+        command->argvSize = flat[c].argc + 1;
+        command->argv = arena_alloc(arena, command->argvSize * sizeof(char *));
+        for (i = 0; i < flat[c].argc; i++) {
+            command->argv[i] = blob + argOffsets[flat[c].firstArg + i];
+        }
+        command->argv[flat[c].argc] = NULL;
+        command->numRedirs = flat[c].numRedirs;
+        if (flat[c].numRedirs > 0) {
+            command->redirs = arena_alloc(arena, flat[c].numRedirs * sizeof(struct redirection));
+            for (i = 0; i < flat[c].numRedirs; i++) {
+                command->redirs[i].fd = redirs[flat[c].firstRedir + i].fd;
+                command->redirs[i].type = redirs[flat[c].firstRedir + i].type;
+                command->redirs[i].target = blob + redirs[flat[c].firstRedir + i].target;
+            }
+        }
+        command->background = flat[c].background;
+        command->connector = flat[c].connector;
+        command->next = flat[c].next != -1 ? &commands[flat[c].next] : NULL;
+        command->nextInList = flat[c].nextInList != -1 ? &commands[flat[c].nextInList] : NULL;
+    }
+    return commands;
+}
+
+// Checks that a flattened block read from outside the shell holds only
+// what parse_cache_flatten() could have written, so inflating it stays
+// inside the block: counts and indexes in range, stages and list links
+// only pointing forward (no loops), and every argument or file name
+// offset in the strings, which end with a NUL. Returns 1 if it does.
+int parse_cache_check(const char *blob, size_t blobSize)
+{
+    const struct flat_command *flat;
+    const struct flat_redirection *redirs;
+    const size_t *argOffsets;
+    size_t numArgs = 0, numRedirs = 0, strings, i;
+    int numCommands, c;
+
+    if (blobSize < sizeof(size_t)) {
+        return 0;
+    }
+    numCommands = *(const int *)blob;
+    if (numCommands <= 0
+            || (size_t)numCommands > (blobSize - sizeof(size_t)) / sizeof(struct flat_command)) {
+        return 0;
+    }
+    flat = (const struct flat_command *)(blob + sizeof(size_t));
+    strings = sizeof(size_t) + numCommands * sizeof(struct flat_command);
+    for (c = 0; c < numCommands; c++) {
+        // Each stage's arguments and redirections follow the last one's
+        if (flat[c].argc <= 0 || flat[c].numRedirs < 0
+                || flat[c].firstArg != (int)numArgs || flat[c].firstRedir != (int)numRedirs
+                || (size_t)flat[c].argc > (blobSize - strings) / sizeof(size_t)) {
+            return 0;
+        }
+        numArgs += flat[c].argc;
+        strings += flat[c].argc * sizeof(size_t);
+        if ((size_t)flat[c].numRedirs > (blobSize - strings) / sizeof(struct flat_redirection)) {
+            return 0;
+        }
+        numRedirs += flat[c].numRedirs;
+        strings += flat[c].numRedirs * sizeof(struct flat_redirection);
+        if ((flat[c].next != -1 && (flat[c].next <= c || flat[c].next >= numCommands))
+                || (flat[c].nextInList != -1 && (flat[c].nextInList <= c || flat[c].nextInList >= numCommands))
+                || flat[c].connector < LIST_END || flat[c].connector > LIST_OR
+                || (flat[c].background != 0 && flat[c].background != 1)) {
+            return 0;
+        }
+    }
+    // Everything above was laid out for numArgs and numRedirs, so the
+    // strings start where the redirections end
+    if (strings >= blobSize || blob[blobSize - 1] != '\0') {
+        return 0;
+    }
+    argOffsets = (const size_t *)(flat + numCommands);
+    redirs = (const struct flat_redirection *)(argOffsets + numArgs);
+    for (i = 0; i < numArgs; i++) {
+        if (argOffsets[i] < strings || argOffsets[i] >= blobSize) {
+            return 0;
+        }
+    }
+    for (i = 0; i < numRedirs; i++) {
+        if (redirs[i].target < strings || redirs[i].target >= blobSize
+                || redirs[i].fd < 0 || redirs[i].type < REDIR_IN || redirs[i].type > REDIR_HERESTRING) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Moves an entry to the newest end of the LRU list
+void parse_cache_touch(struct parse_entry *entry)
+{
+    if (entry == parseNewest) {
+        return;
+    }
+    // Unlink
+    if (entry->newer) entry->newer->older = entry->older;
+    if (entry->older) entry->older->newer = entry->newer;
+    if (entry == parseOldest) parseOldest = entry->newer;
+    // Put at the front
+    entry->newer = NULL;
+    entry->older = parseNewest;
+    if (parseNewest) parseNewest->newer = entry;
+    parseNewest = entry;
+    if (parseOldest == NULL) parseOldest = entry;
+}
+
+// Adds a parsed line to the cache, evicting the least recently used
+// entry when it is full
+void parse_cache_insert(const char *line, unsigned long long hash, struct command *list)
+{
+    struct parse_entry *entry, **link;
+
+    if (parseCount == PARSE_CACHE_SIZE) {
+        entry = parseOldest;
+        parseOldest = entry->newer;
+        if (parseOldest) parseOldest->older = NULL;
+        if (parseNewest == entry) parseNewest = NULL;
+        for (link = &parseBuckets[entry->hash & (PARSE_CACHE_BUCKETS - 1)];
+                *link != entry; link = &(*link)->chain);
+        *link = entry->chain;
+        free(entry->line);
+        free(entry->blob);
+        free(entry);
+        parseCount--;
+    }
+
+    entry = malloc(sizeof(struct parse_entry));
+    if (!entry || !(entry->line = strdup(line))) {
+        fprintf(stderr, "smallsh: allocation error for parse cache\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->hash = hash;
+    entry->blob = parse_cache_flatten(list, &entry->blobSize);
+    entry->chain = parseBuckets[hash & (PARSE_CACHE_BUCKETS - 1)];
+    parseBuckets[hash & (PARSE_CACHE_BUCKETS - 1)] = entry;
+    entry->newer = entry->older = NULL;
+    parse_cache_touch(entry);
+    parseCount++;
+}
+
+// Parses a line of input into the command arena, or takes the parse
+// from the cache if the line was seen before. $ parameters are expanded
+// after, so every line can be cached.
+int parse_cache_parse(char *line, struct command **result)
+{
+    struct parse_entry *entry;
+    unsigned long long hash;
+    char *raw;
+
+    if (!parsecache) {
+        return shell_parse_line(&shellArena, line, result);
+    }
+
+    hash = parse_cache_hash(line);
+    for (entry = parseBuckets[hash & (PARSE_CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->chain) {
+        if (entry->hash == hash && strcmp(entry->line, line) == 0) {
+            shellStats.parseHits++;
+            parse_cache_touch(entry);
+            *result = parse_cache_inflate(&shellArena, entry->blob, entry->blobSize);
+            return 0;
+        }
+    }
+
+    // Parsing writes into the line, keep the raw text for the cache
+    shellStats.parseMisses++;
+    raw = arena_alloc(&shellArena, strlen(line) + 1);
+    strcpy(raw, line);
+    if (shell_parse_line(&shellArena, line, result) == -1) {
+        return -1;
+    }
+    // Blank lines and comments are cheap to parse, leave them out
+    if (*result != NULL) {
+        parse_cache_insert(raw, hash, *result);
+    }
+    return 0;
+}
+
+// Turns a line of input into a command list, parsed or taken from the
+// parse cache. Parameters and globs are left for shell_execute_list(),
+// which expands each pipeline just before running it. Same results as
+// shell_parse_line().
+int shell_parse_input(char *line, struct command **result)
+{
+    return parse_cache_parse(line, result);
+}
+
+// Reads the bodies of a command list's heredocs from the lines after it,
+// in the order the heredocs appear. Each body runs up to a line that is
+// just its delimiter, and has $ parameters expanded like a command line.
+// next hands out the following lines, NULL at the end of input, which
+// ends the body early with a warning like other shells. The parse, even
+// one from a cache, keeps the delimiter, so it is filled in every run.
+// Returns -1 if a body can't be stored.
+int heredoc_collect(struct command *list, char *(*next)(void *), void *source)
+{
+    struct command *item, *stage;
+    struct redirection *redir;
+    char *line, *text = NULL;
+    size_t length = 0;
+    FILE *body;
+    int i;
+
+    for (item = list; item != NULL; item = item->nextInList) {
+        for (stage = item; stage != NULL; stage = stage->next) {
+            for (i = 0; i < stage->numRedirs; i++) {
+                redir = &stage->redirs[i];
+                if (redir->type != REDIR_HEREDOC) {
+                    continue;
+                }
+                body = open_memstream(&text, &length);
+                if (body == NULL) {
+                    perror("smallsh: heredoc");
+                    return -1;
+                }
+                while ((line = next(source)) != NULL && strcmp(line, redir->target) != 0) {
+                    fputs(shell_expand(line), body);
+                    fputc('\n', body);
+                }
+                if (line == NULL) {
+                    fprintf(stderr, "smallsh: warning: heredoc ended by end of input (wanted `%s')\n",
+                            redir->target);
+                }
+                fclose(body);
+                redir->target = arena_alloc(&shellArena, length + 1);
+                memcpy(redir->target, text, length + 1);
+                free(text);
+                text = NULL;
+            }
+        }
+    }
+    return 0;
+}
+
+// FNV-1a hash of a script's text, names its compiled file
+unsigned long long script_hash(const char *text, size_t size)
+{
+    unsigned long long hash = 14695981039346656037ull;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Reads a whole script into a malloc()ed buffer. Sets *regular if it is
+// a regular file, anything else (a pipe, /dev/stdin) isn't compiled.
+// Returns NULL with errno set if it can't be read.
+char *script_read(const char *path, size_t *size, int *regular)
+{
+    struct stat st;
+    size_t allocated = INPUT_BUFFSIZE, used = 0;
+    ssize_t count;
+    char *text;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        *regular = 1;
+        allocated = st.st_size + 1;
+    } else {
+        *regular = 0;
+    }
+    text = malloc(allocated);
+    if (!text) {
+        fprintf(stderr, "smallsh: allocation error for script\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        if (used == allocated) {
+            allocated *= 2;
+            text = realloc(text, allocated);
+            if (!text) {
+                fprintf(stderr, "smallsh: allocation error for script\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        count = read(fd, text + used, allocated - used);
+        if (count > 0) {
+            used += count;
+        } else if (count == 0) {
+            break;
+        } else if (errno != EINTR) {
+            int error = errno;
+            free(text);
+            close(fd);
+            errno = error;
+            return NULL;
+        }
+    }
+    close(fd);
+    *size = used;
+    return text;
+}
+
+// Builds the name of a script's compiled file. With create set the
+// cache directory is made if it doesn't exist. Returns -1 if there is
+// nowhere to keep compiled scripts.
+int script_cache_path(char *path, size_t size, unsigned long long hash, int create)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    char *slash;
+    int length;
+
+    if (base != NULL && *base != '\0') {
+        length = snprintf(path, size, "%s/smallsh", base);
+    } else if ((base = shell_home()) != NULL && *base != '\0') {
+        length = snprintf(path, size, "%s/.cache/smallsh", base);
+    } else {
+        return -1;
+    }
+    if (length < 0 || (size_t)length + 32 > size) {
+        return -1;
+    }
+    if (create) {
+        // Its parent (~/.cache) may not be there yet either
+        slash = strrchr(path, '/');
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+        if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    snprintf(path + length, size - length, "/%016llx.ssc", hash);
+    return 0;
+}
+
+// Maps the compiled file for a script, if there is one matching its
+// text. Returns the mapping, of *mapSize bytes, or NULL.
+char *script_cache_load(unsigned long long hash, const char *text, size_t size,
+        size_t numLines, size_t *mapSize)
+{
+    char path[PATH_MAX];
+    struct script_header *header;
+    struct script_line *lines;
+    struct stat st;
+    size_t i, tableSize;
+    int fd, valid;
+    char *map;
+
+    if (script_cache_path(path, sizeof(path), hash, 0) == -1
+            || (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+        return NULL;
+    }
+    // Only files this user wrote, that nobody else could have changed
+    tableSize = sizeof(struct script_header) + numLines * sizeof(struct script_line);
+    if (fstat(fd, &st) == -1 || st.st_uid != getuid() || (st.st_mode & 022) != 0
+            || (size_t)st.st_size < tableSize + size) {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Same build, same text, and every parse inside the file and sound
+    header = (struct script_header *)map;
+    lines = (struct script_line *)(header + 1);
+    valid = header->magic == SCRIPT_CACHE_MAGIC && header->layout == SCRIPT_CACHE_LAYOUT
+         && header->hash == hash && header->textSize == size && header->numLines == numLines
+         && memcmp(map + tableSize, text, size) == 0;
+    for (i = 0; valid && i < numLines; i++) {
+        if (lines[i].kind == SCRIPT_LINE_BLOB) {
+            valid = lines[i].blob >= tableSize + size && lines[i].blob % 8 == 0
+                 && lines[i].blobSize >= sizeof(size_t)
+                 && lines[i].blobSize <= (unsigned long long)st.st_size - lines[i].blob
+                 && parse_cache_check(map + lines[i].blob, lines[i].blobSize);
+        }
+    }
+    if (!valid) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *mapSize = st.st_size;
+    return map;
+}
+
+// Writes a script's compiled file. It is written under a temporary name
+// and renamed into place, so a shell loading it never sees half a file.
+// Failing to save is not an error, the script just gets parsed next time.
+void script_cache_save(unsigned long long hash, const char *text, size_t size,
+        struct script_line *lines, char **blobs, size_t numLines)
+{
+    static const char zeros[8] = {0};
+    struct script_header header = { SCRIPT_CACHE_MAGIC, SCRIPT_CACHE_LAYOUT, hash, size, numLines };
+    char path[PATH_MAX], temp[PATH_MAX + 8];
+    unsigned long long offset, start;
+    size_t i, padding;
+    FILE *out;
+    int fd, ok;
+
+    if (script_cache_path(path, sizeof(path), hash, 1) == -1) {
+        return;
+    }
+    snprintf(temp, sizeof(temp), "%s.XXXXXX", path);
+    if ((fd = mkostemp(temp, O_CLOEXEC)) == -1) {
+        return;
+    }
+    if ((out = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(temp);
+        return;
+    }
+
+    // Parses follow the text, each one 8 byte aligned
+    start = offset = sizeof(header) + numLines * sizeof(struct script_line) + size;
+    for (i = 0; i < numLines; i++) {
+        if (lines[i].kind == SCRIPT_LINE_BLOB) {
+            offset = (offset + 7) & ~7ull;
+            lines[i].blob = offset;
+            offset += lines[i].blobSize;
+        }
+    }
+
+    ok = fwrite(&header, sizeof(header), 1, out) == 1
+      && fwrite(lines, sizeof(struct script_line), numLines, out) == numLines
+      && fwrite(text, 1, size, out) == size;
+    offset = start;
+    for (i = 0; ok && i < numLines; i++) {
+        if (lines[i].kind == SCRIPT_LINE_BLOB) {
+            padding = lines[i].blob - offset;
+            ok = fwrite(zeros, 1, padding, out) == padding
+              && fwrite(blobs[i], 1, lines[i].blobSize, out) == lines[i].blobSize;
+            offset = lines[i].blob + lines[i].blobSize;
+        }
+    }
+    if (fclose(out) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(temp, path) == -1) {
+        unlink(temp);
+        return;
+    }
+    shellStats.scriptCompiled++;
+}
+
+// Where script_body_line() is in a script's text
+struct script_cursor {
+    const char *text;
+    size_t size;
+    size_t start;      // Start of the next line
+    size_t numLines;   // Lines handed out
+};
+
+// Hands out the lines of a script after the one running, as heredoc
+// bodies. Each is copied to the arena, NUL terminated.
+char *script_body_line(void *source)
+{
+    struct script_cursor *cursor = source;
+    const char *newline;
+    size_t end;
+    char *line;
+
+    if (cursor->start >= cursor->size) {
+        return NULL;
+    }
+    newline = memchr(cursor->text + cursor->start, '\n', cursor->size - cursor->start);
+    end = newline != NULL ? (size_t)(newline - cursor->text) : cursor->size;
+    line = arena_alloc(&shellArena, end - cursor->start + 1);
+    memcpy(line, cursor->text + cursor->start, end - cursor->start);
+    line[end - cursor->start] = '\0';
+    cursor->start = end + 1;
+    cursor->numLines++;
+    return line;
+}
+
+// Runs the commands in a script, a line at a time like shell_loop().
+// With scriptcache on, lines of a script that was compiled before are
+// run from their saved parse, and a script run for the first time is
+// compiled as it runs. Returns 0 if the script ran exit, 1 when it
+// reaches its end, or -1 after printing why it couldn't be read.
+int script_run(const char *path)
+{
+    char *text, *line, *compiled = NULL;
+    char **blobs = NULL;
+    struct script_line *lines = NULL;
+    struct command *command;
+    struct arena outer;
+    unsigned long long hash = 0;
+    size_t size, mapSize = 0, numLines = 0, start, end, i;
+    const char *newline;
+    int regular, result;
+    // Flag that holds return value of executed commands, like shell_loop()
+    int shell_active = 1;
+
+    if (sourceDepth >= SOURCE_MAX_DEPTH) {
+        fprintf(stderr, "smallsh: %s: scripts nested too deeply\n", path);
+        return -1;
+    }
+    text = script_read(path, &size, &regular);
+    if (text == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (start = 0; start < size; start = newline - text + 1, numLines++) {
+        if ((newline = memchr(text + start, '\n', size - start)) == NULL) {
+            newline = text + size;
+        }
+    }
+
+    // Run from the compiled file if there is one, otherwise make it
+    if (scriptcache && regular && numLines > 0) {
+        hash = script_hash(text, size);
+        compiled = script_cache_load(hash, text, size, numLines, &mapSize);
+        if (compiled != NULL) {
+            shellStats.scriptHits++;
+            lines = (struct script_line *)(compiled + sizeof(struct script_header));
+        } else {
+            lines = calloc(numLines, sizeof(struct script_line));
+            blobs = calloc(numLines, sizeof(char *));
+            if (!lines || !blobs) {
+                fprintf(stderr, "smallsh: allocation error for script\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // A sourced script gets its own arena, the line that ran source is
+    // still using the shell's
+    outer = shellArena;
+    memset(&shellArena, 0, sizeof(shellArena));
+    sourceDepth++;
+
+    for (start = 0, i = 0; start < size && shell_active; start = end + 1, i++) {
+        newline = memchr(text + start, '\n', size - start);
+        end = newline != NULL ? (size_t)(newline - text) : size;
+
+        // Report background processes that finished
+        background_check();
+        // Fork replacement pool workers between commands
+        pool_refill();
+
+        command = NULL;
+        result = 0;
+        if (compiled != NULL && lines[i].kind == SCRIPT_LINE_BLOB) {
+            command = parse_cache_inflate(&shellArena, compiled + lines[i].blob, lines[i].blobSize);
+        } else if (compiled == NULL || lines[i].kind == SCRIPT_LINE_PARSE) {
+            line = arena_alloc(&shellArena, end - start + 1);
+            memcpy(line, text + start, end - start);
+            line[end - start] = '\0';
+            if (blobs != NULL) {
+                // Compiling
+                result = shell_parse_line(&shellArena, line, &command);
+                if (result == 0 && command == NULL) {
+                    lines[i].kind = SCRIPT_LINE_EMPTY;
+                } else if (result == 0) {
+                    size_t blobSize;
+                    blobs[i] = parse_cache_flatten(command, &blobSize);
+                    lines[i].kind = SCRIPT_LINE_BLOB;
+                    lines[i].blobSize = blobSize;
+                }
+            } else {
+                result = shell_parse_input(line, &command);
+            }
+        }
+        if (result == 0 && command != NULL) {
+            // Heredoc bodies are the lines after this one, skip over them
+            struct script_cursor cursor = { text, size, end + 1, 0 };
+            if (heredoc_collect(command, script_body_line, &cursor) == 0) {
+                shell_active = shell_execute_list(command);
+            }
+            end = cursor.start - 1;
+            i += cursor.numLines;
+        }
+
+        // Release the line and its parse in one go
+        arena_reset(&shellArena);
+    }
+
+    sourceDepth--;
+    if (shellArena.peak > outer.peak) {
+        outer.peak = shellArena.peak;
+    }
+    arena_free(&shellArena);
+    shellArena = outer;
+
+    if (blobs != NULL) {
+        script_cache_save(hash, text, size, lines, blobs, numLines);
+        for (i = 0; i < numLines; i++) {
+            free(blobs[i]);
+        }
+        free(blobs);
+        free(lines);
+    }
+    if (compiled != NULL) {
+        munmap(compiled, mapSize);
+    }
+    free(text);
+    return shell_active;
+}
+
+// Returns 1 if a word has glob characters in it
+int glob_has_magic(const char *word)
+{
+    return strpbrk(word, "*?[") != NULL;
+}
+
+// Matches c against the [...] class starting at p. Returns the length of
+// the class and sets *matched, or 0 if there is no closing ] (then the
+// [ is just a character).
+int glob_class(const char *p, char c, int *matched)
+{
+    const char *q = p + 1;
+    int negate = 0;
+
+    if (*q == '!' || *q == '^') {
+        negate = 1;
+        q++;
+    }
+    *matched = 0;
+    // A ] right after the [ is part of the class
+    do {
+        if (*q == '\0') {
+            return 0;
+        }
+        if (q[1] == '-' && q[2] != ']' && q[2] != '\0') {
+            if ((unsigned char)c >= (unsigned char)q[0] && (unsigned char)c <= (unsigned char)q[2]) {
+                *matched = 1;
+            }
+            q += 3;
+        } else {
+            if (c == *q) {
+                *matched = 1;
+            }
+            q++;
+        }
+    } while (*q != ']');
+    *matched ^= negate;
+    return q + 1 - p;
+}
+
+// Matches a name against one glob pattern component. Instead of
+// backtracking recursively, only the position after the last * is
+// remembered; on a mismatch that * takes one more character and
+// matching carries on from there. Names starting with . only match a
+// pattern that starts with one.
+int glob_match(const char *pattern, const char *name)
+{
+    const char *p = pattern, *n = name;
+    const char *starP = NULL, *starN = NULL;
+    int length, matched;
+
+    if (*name == '.' && *pattern != '.') {
+        return 0;
+    }
+    while (*n != '\0') {
+        if (*p == '*') {
+            while (*p == '*') p++;
+            starP = p;
+            starN = n;
+            continue;
+        }
+        if (*p == '?') {
+            p++;
+            n++;
+            continue;
+        }
+        if (*p == '[' && (length = glob_class(p, *n, &matched)) > 0) {
+            if (matched) {
+                p += length;
+                n++;
+                continue;
+            }
+        } else if (*p == *n) {
+            p++;
+            n++;
+            continue;
+        }
+        // Mismatch, let the last * swallow one more character
+        if (starP == NULL) {
+            return 0;
+        }
+        p = starP;
+        n = ++starN;
+    }
+    while (*p == '*') p++;
+    return *p == '\0';
+}
+
+// Layout of the records getdents64() fills the buffer with
+struct glob_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Returns the listing of a directory ("" for the current one), from the
+// cache when the directory hasn't changed, NULL if it can't be read
+struct glob_dir *glob_dir_read(const char *path)
+{
+    static char buffer[65536];
+    struct glob_dir *dir = NULL;
+    struct timespec now;
+    struct stat info;
+    char *text = NULL;
+    size_t textSize = 0, textUsed = 0, length;
+    long count, offset;
+    int fd, i, numNames = 0;
+
+    fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return NULL;
+    }
+    for (i = 0; i < GLOB_DIR_CACHE_SIZE; i++) {
+        if (globDirs[i].names != NULL && globDirs[i].dev == info.st_dev && globDirs[i].ino == info.st_ino) {
+            dir = &globDirs[i];
+            break;
+        }
+    }
+    if (dir != NULL && dir->settled && dir->mtime.tv_sec == info.st_mtim.tv_sec
+            && dir->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+        close(fd);
+        shellStats.globDirHits++;
+        return dir;
+    }
+
+    // Read the names in big batches, one after another in text
+    shellStats.globDirReads++;
+    while ((count = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (offset = 0; offset < count; ) {
+            struct glob_dirent64 *entry = (struct glob_dirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            length = strlen(entry->d_name) + 1;
+            if (textUsed + length > textSize) {
+                textSize = textSize ? textSize * 2 : 4096;
+                while (textUsed + length > textSize) textSize *= 2;
+                text = realloc(text, textSize);
+                if (!text) {
+                    fprintf(stderr, "smallsh: allocation error for glob\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(text + textUsed, entry->d_name, length);
+            textUsed += length;
+            numNames++;
+        }
+    }
+    close(fd);
+
+    // Reuse the directory's old slot, or take the next one
+    if (dir == NULL) {
+        dir = &globDirs[globDirNext];
+        globDirNext = (globDirNext + 1) % GLOB_DIR_CACHE_SIZE;
+    }
+    free(dir->names);
+    dir->names = malloc(numNames * sizeof(char *) + textUsed + 1);
+    if (!dir->names) {
+        fprintf(stderr, "smallsh: allocation error for glob\n");
+        exit(EXIT_FAILURE);
+    }
+    if (textUsed > 0) {
+        memcpy((char *)(dir->names + numNames), text, textUsed);
+    }
+    free(text);
+    text = (char *)(dir->names + numNames);
+    for (i = 0; i < numNames; i++) {
+        dir->names[i] = text;
+        text += strlen(text) + 1;
+    }
+    dir->numNames = numNames;
+    dir->dev = info.st_dev;
+    dir->ino = info.st_ino;
+    dir->mtime = info.st_mtim;
+    clock_gettime(CLOCK_REALTIME, &now);
+    dir->settled = (now.tv_sec - info.st_mtim.tv_sec) * 1000000000L
+                 + (now.tv_nsec - info.st_mtim.tv_nsec) > GLOB_SETTLE_NS;
+    return dir;
+}
+
+int glob_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Adds a path to a growing list of paths in the arena
+void glob_list_add(struct arena *arena, char ***list, int *count, int *size, char *path)
+{
+    if (*count == *size) {
+        int newSize = *size ? *size * 2 : 16;
+        *list = arena_grow(arena, *list, *size * sizeof(char *), newSize * sizeof(char *));
+        *size = newSize;
+    }
+    (*list)[(*count)++] = path;
+}
+
+// Expands one glob word into the command's arguments, in sorted order.
+// The pattern is matched a path component at a time: each component
+// with glob characters is matched against the listing of every
+// directory matched so far, plain components are just added on.
+// Returns the number of arguments added, 0 if nothing matched.
+int glob_word(struct arena *arena, struct command *command, const char *word)
+{
+    char *pattern, *component, *slash, *path;
+    char **paths = NULL, **next;
+    int numPaths = 0, pathsSize = 0, numNext, nextSize;
+    int i, j, last, literalLast = 0, trailingSlash = 0;
+    size_t length;
+    struct glob_dir *dir;
+    struct stat info;
+
+    length = strlen(word);
+    pattern = arena_alloc(arena, length + 1);
+    memcpy(pattern, word, length + 1);
+    while (length > 1 && pattern[length - 1] == '/') {
+        pattern[--length] = '\0';
+        trailingSlash = 1;
+    }
+
+    // Absolute patterns start from /, relative ones from the current directory
+    component = pattern;
+    glob_list_add(arena, &paths, &numPaths, &pathsSize, *pattern == '/' ? "/" : "");
+    while (*component == '/') component++;
+
+    while (*component != '\0' && numPaths > 0) {
+        slash = strchr(component, '/');
+        last = (slash == NULL);
+        if (!last) {
+            *slash = '\0';
+        }
+        next = NULL;
+        numNext = nextSize = 0;
+        for (i = 0; i < numPaths; i++) {
+            if (!glob_has_magic(component)) {
+                // Nothing to match, the file is checked for at the end
+                length = strlen(paths[i]) + strlen(component) + 2;
+                path = arena_alloc(arena, length);
+                snprintf(path, length, "%s%s%s", paths[i], component, last ? "" : "/");
+                glob_list_add(arena, &next, &numNext, &nextSize, path);
+                literalLast = last;
+                continue;
+            }
+            if ((dir = glob_dir_read(paths[i])) == NULL) {
+                continue;
+            }
+            for (j = 0; j < dir->numNames; j++) {
+                if (glob_match(component, dir->names[j])) {
+                    length = strlen(paths[i]) + strlen(dir->names[j]) + 2;
+                    path = arena_alloc(arena, length);
+                    snprintf(path, length, "%s%s%s", paths[i], dir->names[j], last ? "" : "/");
+                    glob_list_add(arena, &next, &numNext, &nextSize, path);
+                }
+            }
+        }
+        paths = next;
+        numPaths = numNext;
+        pathsSize = nextSize;
+        if (last) {
+            break;
+        }
+        component = slash + 1;
+        while (*component == '/') component++;
+    }
+
+    if (numPaths > 1) {
+        qsort(paths, numPaths, sizeof(char *), glob_compare);
+    }
+    j = 0;
+    for (i = 0; i < numPaths; i++) {
+        // A plain last component or a trailing / still has to be checked
+        if ((literalLast || trailingSlash) && (lstat(paths[i], &info) == -1
+                || (trailingSlash && stat(paths[i], &info) == -1)
+                || (trailingSlash && !S_ISDIR(info.st_mode)))) {
+            continue;
+        }
+        if (trailingSlash) {
+            length = strlen(paths[i]) + 2;
+            path = arena_alloc(arena, length);
+            snprintf(path, length, "%s/", paths[i]);
+            paths[i] = path;
+        }
+        command_add_arg(arena, command, paths[i]);
+        j++;
+    }
+    return j;
+}
+
+// Expands the glob words in every command of a pipeline, in place.
+// Words that match nothing are kept as they are, like other shells do.
+void glob_expand_pipeline(struct arena *arena, struct command *pipeline)
+{
+    struct command *stage;
+    char **words;
+    int i, numWords, magic;
+
+    for (stage = pipeline; stage != NULL; stage = stage->next) {
+        for (i = 0, magic = 0; i < stage->argc && !magic; i++) {
+            magic = glob_has_magic(stage->argv[i]);
+        }
+        if (!magic) {
+            continue;
+        }
+        // Build argv again, expanded words go straight into it
+        words = stage->argv;
+        numWords = stage->argc;
+        stage->argv = NULL;
+        stage->argc = stage->argvSize = 0;
+        for (i = 0; i < numWords; i++) {
+            if (!glob_has_magic(words[i]) || glob_word(arena, stage, words[i]) == 0) {
+                command_add_arg(arena, stage, words[i]);
+            }
+        }
+    }
+}
+
+// Runs each pipeline of a ; && || list in turn. && and || look at the
+// result of the last pipeline that ran, so a && b || c runs c if either
+// a or b failed. A word starting with # comments out the rest of the
+// line. Each pipeline's parameters and globs are expanded right before
+// it runs, so $? and the files matched see what the ones before it did.
+// Returns 0 once a command asked the shell to exit.
+int shell_execute_list(struct command *list)
+{
+    struct command *item;
+    int run = 1;
+
+    for (item = list; item != NULL; item = item->nextInList) {
+        if (run) {
+            if (shell_expand_pipeline(item) == -1) {
+                commandStatus = EXIT_FAILURE << 8;
+            } else {
+                if (glob) {
+                    glob_expand_pipeline(&shellArena, item);
+                }
+                if (shell_execute(item) == 0) {
+                    return 0;
+                }
+            }
+        }
+        if (item->connector == LIST_AND) {
+            run = (commandStatus == 0);
+        } else if (item->connector == LIST_OR) {
+            run = (commandStatus != 0);
+        } else {
+            run = 1;
+        }
+    }
+    return 1;
+}
+
+// Finds a built in or prefix command by name, returns its index in
+// builtin_str or -1 if it isn't one
+int builtin_lookup(const char *name)
+{
+    int i = builtinSlots[builtin_hash(name, builtinSeed)];
+
+    // Only the builtin in the name's slot can match
+    if (i != -1 && strcmp(name, builtin_str[i]) == 0) {
+        return i;
+    }
+    return -1;
+}
+
+/* Function to handle execution of built in commands, comments, and blank lines */
+int shell_execute(struct command *command)
+{
+    // A comment or emtpy line was entered, the scanner ended the line
+    // at the #
+    if (command == NULL) {
+        return 1;
+    }
+    // Its words all expanded to nothing, that succeeds without running
+    // anything
+    if (command->argc == 0) {
+        commandStatus = 0;
+        return 1;
+    }
+
+    // One lookup finds builtins and prefix commands. Prefixes (time,
+    // iotune, limit, pin, remote) run the rest of the command, pipelines
+    // included, and count it themselves when they run it.
+    int numBuiltins = shell_num_builtins();
+    int i = builtin_lookup(command->argv[0]);
+    if (i >= numBuiltins) {
+        return (*prefix_func[i - numBuiltins])(command);
+    }
+
+    shellStats.commands++;
+    // Built in commands run in the shell, unless part of a pipeline
+    if (i != -1 && command->next == NULL) {
+        // If built in, pass arguments to function pointer for that
+        // command. Builtins succeed unless they set commandStatus.
+        shellStats.builtins++;
+        commandStatus = 0;
+        return (*builtin_func[i])(command->argv);
+    }
+
+    // Plain file copies can be done without launching cat at all
+    if (fastcopy && fastcopy_try(command)) {
+        commandStatus = status;
+        return 1;
+    }
+
+    // If command is not built in, passes arguments to be forked and executed
+    shellStats.externals++;
+    i = shell_launch(command);
+    // A background command counts as started successfully
+    commandStatus = (command->background && backgroundAllowed) ? 0 : status;
+    return i;
+}
+
+// The time prefix, runs the rest of the command (builtin, pipeline or
+// not) and prints its wall clock time and resource usage to stderr like
+// other shells do. Background commands are reported when they finish.
+int shell_time(struct command *command)
+{
+    struct timespec start, end;
+    struct rusage usage = {0};
+    long jobsBefore = foregroundJobs;
+    pid_t backgroundBefore = lastBackgroundPid;
+    int result = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Drop the time word, the line is parsed once so argv is never grown again
+    command->argv++;
+    command->argc--;
+    command->timed = 1;
+    if (command->argc > 0) {
+        result = shell_execute(command);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (command->argc > 0 && lastBackgroundPid != backgroundBefore) {
+        return result;
+    }
+    // A builtin or fast path ran in the shell, so only the time is known
+    if (foregroundJobs != jobsBefore) {
+        usage = lastUsage;
+    }
+    usage_report(stderr, &usage, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    return result;
+}
+
+// Reads a size with an optional k, m or g suffix. Returns -1 if it isn't one.
+int size_parse(const char *text, long long *size)
+{
+    char *end;
+
+    errno = 0;
+    *size = strtoll(text, &end, 10);
+    if (end == text || errno != 0) {
+        return -1;
+    }
+    if (*end == 'k' || *end == 'K') *size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M') *size <<= 20, end++;
+    else if (*end == 'g' || *end == 'G') *size <<= 30, end++;
+    return *end == '\0' ? 0 : -1;
+}
+
+// Reads a list of numbers and ranges like 0-3,8,10-11 into a set.
+// Returns -1 if it isn't one.
+int cpu_list_parse(const char *text, cpu_set_t *set)
+{
+    const char *p = text;
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    do {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0) {
+            return -1;
+        }
+        last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, set);
+        }
+        p = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
+}
+
+// The limit and pin prefixes, run the rest of the command with resource
+// limits, a priority or a placement. They can be combined, as in
+// limit -n 256 pin -c 4-7 command, and apply to every stage of a pipeline.
+//   limit [-t seconds] [-v size[k|m|g]] [-n files] [-N nice] [-I class[:level]] command...
+//   -t      CPU time limit (RLIMIT_CPU)
+//   -v      address space limit (RLIMIT_AS)
+//   -n      open files limit (RLIMIT_NOFILE)
+//   -N      nice value
+//   -I      I/O priority class rt, be or idle, with level 0-7 for rt and be
+//   pin [-c cpus] [-b nodes | -i nodes | -p node] command...
+//   -c      run on these CPUs (0-3,8)
+//   -b      allocate memory only on these NUMA nodes
+//   -i      interleave memory over these nodes
+//   -p      prefer this node for memory
+int shell_limit(struct command *command)
+{
+    static const char *ioClassNames[] = { "rt", "be", "idle" };
+    struct launch_attrs attrs = launchAttrs, saved = launchAttrs;
+    const char *name = command->argv[0];
+    int pin = strcmp(name, "pin") == 0;
+    long long number;
+    char *level;
+    int i, result;
+
+    command->argv++;
+    command->argc--;
+    while (command->argc > 0 && command->argv[0][0] == '-') {
+        char *option = command->argv[0];
+        char *value = command->argv[1];
+        int bad = 0;
+
+        if (value == NULL || option[1] == '\0' || option[2] != '\0') {
+            bad = 1;
+        } else if (!pin && (option[1] == 't' || option[1] == 'v' || option[1] == 'n')) {
+            int which = option[1] == 't' ? 0 : option[1] == 'v' ? 1 : 2;
+            if (size_parse(value, &number) == -1 || number < 0) {
+                fprintf(stderr, "smallsh: limit: %s: invalid limit\n", value);
+                commandStatus = EXIT_FAILURE << 8;
+                return 1;
+            }
+            attrs.limits[which] = number;
+            attrs.limitsSet |= 1 << which;
+        } else if (!pin && option[1] == 'N') {
+            attrs.nice = atoi(value);
+            attrs.niceSet = 1;
+        } else if (!pin && option[1] == 'I') {
+            level = strchr(value, ':');
+            size_t length = level ? (size_t)(level - value) : strlen(value);
+            for (i = 0; i < 3 && (strlen(ioClassNames[i]) != length
+                    || strncmp(value, ioClassNames[i], length) != 0); i++);
+            if (i == 3 || (level != NULL && (atoi(level + 1) < 0 || atoi(level + 1) > 7))) {
+                fprintf(stderr, "smallsh: limit: %s: unknown I/O class\n", value);
+                commandStatus = EXIT_FAILURE << 8;
+                return 1;
+            }
+            // Best effort level 4 is the kernel's default
+            attrs.ioprio = ((i + 1) << IOPRIO_CLASS_SHIFT) | (level ? atoi(level + 1) : 4);
+        } else if (pin && option[1] == 'c') {
+            if (cpu_list_parse(value, &attrs.cpus) == -1) {
+                fprintf(stderr, "smallsh: pin: %s: invalid CPU list\n", value);
+                commandStatus = EXIT_FAILURE << 8;
+                return 1;
+            }
+            attrs.cpusSet = 1;
+        } else if (pin && (option[1] == 'b' || option[1] == 'i' || option[1] == 'p')) {
+            if (cpu_list_parse(value, &attrs.memNodes) == -1
+                    || (option[1] == 'p' && CPU_COUNT(&attrs.memNodes) != 1)) {
+                fprintf(stderr, "smallsh: pin: %s: invalid node list\n", value);
+                commandStatus = EXIT_FAILURE << 8;
+                return 1;
+            }
+            attrs.memPolicy = option[1] == 'b' ? MPOL_BIND
+                            : option[1] == 'i' ? MPOL_INTERLEAVE : MPOL_PREFERRED;
+        } else {
+            bad = 1;
+        }
+        if (bad) {
+            if (pin) {
+                fprintf(stderr, "smallsh: pin: usage: pin [-c cpus] [-b nodes | -i nodes | -p node] command...\n");
+            } else {
+                fprintf(stderr, "smallsh: limit: usage: limit [-t seconds] [-v size] [-n files] [-N nice] [-I class[:level]] command...\n");
+            }
+            commandStatus = EXIT_FAILURE << 8;
+            return 1;
+        }
+        command->argv += 2;
+        command->argc -= 2;
+    }
+    if (command->argc == 0) {
+        return 1;
+    }
+
+    attrs.active = 1;
+    launchAttrs = attrs;
+    result = shell_execute(command);
+    launchAttrs = saved;
+    return result;
+}
+
+// Applies the limit and pin settings to the process itself, called in
+// the child before exec. Returns -1 after printing what failed.
+int launch_apply_attrs(void)
+{
+    struct rlimit limit;
+    int i;
+
+    for (i = 0; i < LAUNCH_NUM_LIMITS; i++) {
+        if (launchAttrs.limitsSet & (1 << i)) {
+            limit.rlim_cur = limit.rlim_max = launchAttrs.limits[i];
+            if (setrlimit(launchLimitResources[i], &limit) == -1) {
+                perror("smallsh: limit: setrlimit");
+                return -1;
+            }
+        }
+    }
+    if (launchAttrs.niceSet && setpriority(PRIO_PROCESS, 0, launchAttrs.nice) == -1) {
+        perror("smallsh: limit: setpriority");
+        return -1;
+    }
+    if (launchAttrs.ioprio != -1
+            && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, launchAttrs.ioprio) == -1) {
+        perror("smallsh: limit: ioprio_set");
+        return -1;
+    }
+    if (launchAttrs.cpusSet
+            && sched_setaffinity(0, sizeof(cpu_set_t), &launchAttrs.cpus) == -1) {
+        perror("smallsh: pin: sched_setaffinity");
+        return -1;
+    }
+    // maxnode counts one past the last node, as with the glibc wrapper
+    if (launchAttrs.memPolicy != -1
+            && syscall(SYS_set_mempolicy, launchAttrs.memPolicy, &launchAttrs.memNodes,
+                    (unsigned long)CPU_SETSIZE + 1) == -1) {
+        perror("smallsh: pin: set_mempolicy");
+        return -1;
+    }
+    return 0;
+}
+
+// Pins the processes of a background job to the next CPU in round robin
+// order, unless pin already placed them. Processes that exited already
+// are skipped.
+void launch_round_robin(int job)
+{
+    cpu_set_t cpu;
+    int i;
+
+    if (!roundRobinLoaded) {
+        if (sched_getaffinity(0, sizeof(cpu_set_t), &roundRobinCPUs) == -1
+                || CPU_COUNT(&roundRobinCPUs) == 0) {
+            return;
+        }
+        roundRobinLoaded = 1;
+    }
+    while (!CPU_ISSET(roundRobinNext % CPU_SETSIZE, &roundRobinCPUs)) {
+        roundRobinNext = (roundRobinNext + 1) % CPU_SETSIZE;
+    }
+    CPU_ZERO(&cpu);
+    CPU_SET(roundRobinNext, &cpu);
+    roundRobinNext = (roundRobinNext + 1) % CPU_SETSIZE;
+    for (i = 0; i < jobTable[job].numProcs; i++) {
+        if (jobTable[job].procs[i].pid > 0) {
+            sched_setaffinity(jobTable[job].procs[i].pid, sizeof(cpu_set_t), &cpu);
+        }
+    }
+}
+
+// The iotune prefix, runs the rest of the command with its redirection
+// files opened for heavy I/O
+//   iotune [-p size[k|m|g]] [-d] [-s] [-a advice] command...
+//   -p      preallocate output files with fallocate()
+//   -d      open output files O_DIRECT (the command has to write aligned blocks)
+//   -s      open output files O_DSYNC
+//   -a      posix_fadvise() input files: sequential, random, noreuse,
+//           willneed or dontneed
+int shell_iotune(struct command *command)
+{
+    static const char *adviceNames[] = { "sequential", "random", "noreuse", "willneed", "dontneed" };
+    static const int adviceValues[] = { POSIX_FADV_SEQUENTIAL, POSIX_FADV_RANDOM,
+            POSIX_FADV_NOREUSE, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED };
+    struct io_tune tune = { 1, 0, 0, -1 };
+    long long size;
+    int i, result = 1;
+
+    // Take options off the front of argv, like time does with its word
+    command->argv++;
+    command->argc--;
+    while (command->argc > 0 && command->argv[0][0] == '-') {
+        char *option = command->argv[0];
+        char *value = command->argv[1];
+        if (strcmp(option, "-d") == 0) {
+            tune.outputFlags |= O_DIRECT;
+        } else if (strcmp(option, "-s") == 0) {
+            tune.outputFlags |= O_DSYNC;
+        } else if (strcmp(option, "-p") == 0 && value != NULL) {
+            if (size_parse(value, &size) == -1 || size <= 0) {
+                fprintf(stderr, "smallsh: iotune: %s: invalid size\n", value);
+                commandStatus = EXIT_FAILURE << 8;
+                return 1;
+            }
+            tune.preallocate = size;
+        } else if (strcmp(option, "-a") == 0 && value != NULL) {
+            for (i = 0; i < 5 && strcmp(value, adviceNames[i]) != 0; i++);
+            if (i == 5) {
+                fprintf(stderr, "smallsh: iotune: %s: unknown advice\n", value);
+                commandStatus = EXIT_FAILURE << 8;
+                return 1;
+            }
+            tune.advice = adviceValues[i];
+        } else {
+            fprintf(stderr, "smallsh: iotune: usage: iotune [-p size] [-d] [-s] [-a advice] command...\n");
+            commandStatus = EXIT_FAILURE << 8;
+            return 1;
+        }
+        // Options with a value take two words
+        i = (strcmp(option, "-p") == 0 || strcmp(option, "-a") == 0) ? 2 : 1;
+        command->argv += i;
+        command->argc -= i;
+    }
+    if (command->argc == 0) {
+        return 1;
+    }
+
+    ioTune = tune;
+    result = shell_execute(command);
+    ioTune.active = 0;
+    ioTune.preallocate = 0;
+    ioTune.outputFlags = 0;
+    ioTune.advice = -1;
+    return result;
+}
+
+// Function to handle launching of non built in commands. Background
+// jobs are left running, foreground jobs are waited for.
+int shell_launch(struct command *command)
+{
+    int job;
+    // Foreground-only mode ignores &
+    int background = command->background && backgroundAllowed;
+
+    // Hold off the SIGCHLD handler until the children are recorded, in
+    // case they exit right away
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+
+    // With job control every job gets its own group, so it can be
+    // given the terminal and stopped on its own
+    job = launch_job(command, background, background || monitor);
+    if (job == -1) {  // Nothing launched, so nothing to wait for
+
+    } else {  // This is the parent process
+        if(background) {
+            // Print background job's process group, the pid of its first process
+            lastBackgroundPid = jobTable[job].pgid;
+            jobCurrent = job;
+            if (roundrobin && !launchAttrs.cpusSet) {
+                launch_round_robin(job);
+            }
+            printf("background pid is %d\n", lastBackgroundPid);
+            fflush(stdout);
+        }
+        // Otherwise, not a background process
+        // Wait for foreground job to finish
+        else{
+            foreground_wait(job);
+
+        // Catch and print signal
+            if (WIFSIGNALED(status)){
+                printf("terminated by signal %d\n", status);
+                fflush(stdout);
+            }
+        }
+    }
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+
+    // Returns 1 to keep user loop going
+    return 1;
+}
+
+// Launches every stage of a pipeline back to back, connected by pipes,
+// and records them as a single job. SIGCHLD must be blocked. With
+// ownGroup the job gets a new process group, led by the first stage,
+// otherwise it stays in the shell's group so it gets terminal signals.
+// Returns the job's index, or -1 (with status set) if no process could
+// be launched at all.
+int launch_job(struct command *command, int background, int ownGroup)
+{
+    struct launch_spec spec;
+    struct command *stage;
+    pid_t pid;       // Process id of launched child
+    int stageIn, stageOut; // Pipe ends for stdin and stdout of a stage
+    int pipeFDs[2];
+    int job, first, last;
+
+    job = job_create(command, background);
+    jobTable[job].ownGroup = ownGroup;
+    spec.pgid = ownGroup ? 0 : -1;
+    spec.background = background;
+    spec.jobControl = monitor;
+    spec.cgroupFD = jobTable[job].cgroupFD;
+    stageIn = -1;
+    for (stage = command; stage != NULL; stage = stage->next) {
+        first = (stage == command);
+        last = (stage->next == NULL);
+
+        // Each stage in between writes into a pipe read by the next one
+        stageOut = -1;
+        pipeFDs[0] = -1;
+        if (!last) {
+            if (pipe2(pipeFDs, O_CLOEXEC) == -1) {
+                perror("smallsh");
+                job_add_process(job, 0, EXIT_FAILURE << 8);
+                if (stageIn != -1) close(stageIn);
+                break;
+            }
+            stageOut = pipeFDs[1];
+        }
+
+        // Open redirection files up front, so both launch engines
+        // only need to wire them into place in the child
+        pid = -1;
+        spec.argv = stage->argv;
+        if (launch_open_redirects(stage, &spec, stageIn, stageOut,
+                background && first, background && last) == -1) {
+            // Error message already printed
+        }
+        // Find the command, names containing a slash are used as is
+        else if (strchr(stage->argv[0], '/') == NULL
+                && (spec.path = path_lookup(stage->argv[0])) == NULL) {
+            perror("smallsh");
+        }
+        else {
+            if (strchr(stage->argv[0], '/') != NULL) {
+                spec.path = stage->argv[0];
+            }
+            struct timespec before, after;
+            clock_gettime(CLOCK_MONOTONIC, &before);
+            // Use an idle pool worker if there is one. Limits, placement
+            // and cgroups are set up in a forked child.
+            int forkOnly = launchAttrs.active || spec.cgroupFD != -1;
+            pid = poolIdle > 0 && !forkOnly ? pool_launch(&spec) : -1;
+            if (pid > 0) {
+                // Launched by the worker
+            }
+            else if (launchEngine == LAUNCH_SPAWN && !forkOnly) {
+                pid = launch_spawn(&spec);
+                shellStats.spawnLaunches++;
+            }
+            else {
+                pid = launch_fork(&spec);
+                shellStats.forkLaunches++;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &after);
+            long launchNs = (after.tv_sec - before.tv_sec) * 1000000000L
+                          + (after.tv_nsec - before.tv_nsec);
+            jobTable[job].launchNs += launchNs;
+            stats_record(shellStats.launchHistogram, &shellStats.launchNs, launchNs);
+        }
+        launch_close_redirects(&spec);
+
+        if (pid > 0) {
+            job_add_process(job, pid, 0);
+            if (spec.pgid == 0) {
+                spec.pgid = pid;
+            }
+        } else {
+            // Same status as a child that failed to exec
+            job_add_process(job, 0, EXIT_FAILURE << 8);
+        }
+
+        // The shell's copies of the pipe ends belong to the children now
+        if (stageIn != -1) close(stageIn);
+        if (stageOut != -1) close(stageOut);
+        stageIn = pipeFDs[0];
+    }
+
+    if (jobTable[job].numLive == 0) {
+        status = job_final_status(&jobTable[job]);
+        job_release(job);
+        return -1;
+    }
+    return job;
+}
+
+// Signal handler for SIGINT while the shell is copying a file or
+// waiting for jobs itself
+void catchShellSIGINT(int signo)
+{
+    shellInterrupted = 1;
+}
+
+// Copies everything from one descriptor to another, using
+// copy_file_range() so the kernel moves the data (or shares extents),
+// falling back to sendfile() and then read()/write() when the file
+// systems don't support it. Returns -1 on error.
+int fastcopy_copy(int inputFD, int outputFD)
+{
+    static char buffer[65536];
+    const size_t chunk = 1 << 24; // Check for SIGINT every 16M
+    ssize_t copied, written;
+    int method = 0; // 0 copy_file_range, 1 sendfile, 2 read/write
+
+    while (!shellInterrupted) {
+        if (method == 0) {
+            copied = copy_file_range(inputFD, NULL, outputFD, NULL, chunk, 0);
+        } else if (method == 1) {
+            copied = sendfile(outputFD, inputFD, NULL, chunk);
+        } else {
+            copied = read(inputFD, buffer, sizeof(buffer));
+            for (written = 0; copied > 0 && written < copied; ) {
+                ssize_t n = write(outputFD, buffer + written, copied - written);
+                if (n == -1 && errno != EINTR) return -1;
+                if (n > 0) written += n;
+            }
+        }
+
+        if (copied == 0) {
+            return 0; // End of input
+        }
+        if (copied == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Nothing copied yet with this method, try the next one
+            if (method < 2 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                    || errno == EOPNOTSUPP || errno == EBADF)) {
+                method++;
+                continue;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Fast path for commands that only copy a file, like cat < a > b.
+// The copy is done by the shell itself instead of launching cat.
+// Only taken when the result is the same as running cat: a foreground
+// cat with no arguments, reading a regular file and writing a regular
+// file (or a new one) that isn't the input file. Returns 1 if the command
+// was handled, 0 if it still needs to be launched.
+int fastcopy_try(struct command *command)
+{
+    struct stat inputInfo, outputInfo;
+    struct sigaction copyAction = {0}, oldAction;
+    int inputFD, outputFD, result;
+    const char *inputFile, *outputFile;
+
+    if (strcmp(command->argv[0], "cat") != 0 || command->argc != 1) {
+        return 0;
+    }
+    // Needs exactly < file and > file, pipelines and background jobs are launched
+    if (command->numRedirs != 2 || command->next != NULL
+            || (command->background && backgroundAllowed)
+            || command->redirs[0].type == command->redirs[1].type) {
+        shellStats.fastcopyDeclined++;
+        return 0;
+    }
+    inputFile = command->redirs[command->redirs[0].type == REDIR_IN ? 0 : 1].target;
+    outputFile = command->redirs[command->redirs[0].type == REDIR_IN ? 1 : 0].target;
+    if (command->redirs[0].fd != (command->redirs[0].type == REDIR_IN ? 0 : 1)
+            || command->redirs[1].fd != (command->redirs[1].type == REDIR_IN ? 0 : 1)
+            || command->redirs[0].type >= REDIR_APPEND || command->redirs[1].type >= REDIR_APPEND) {
+        shellStats.fastcopyDeclined++;
+        return 0;
+    }
+    // cat has to exist, otherwise the launch reports the error. Tuned
+    // files (O_DIRECT needs aligned buffers) are left to cat as well.
+    if (ioTune.active || path_lookup("cat") == NULL) {
+        shellStats.fastcopyDeclined++;
+        return 0;
+    }
+
+    inputFD = open(inputFile, O_RDONLY | O_CLOEXEC);
+    if (inputFD == -1 || fstat(inputFD, &inputInfo) == -1 || !S_ISREG(inputInfo.st_mode)) {
+        // Let the launch path report errors or handle fifos and devices
+        if (inputFD != -1) close(inputFD);
+        shellStats.fastcopyDeclined++;
+        return 0;
+    }
+    // The output has to be a regular file, and not the input itself,
+    // checked before it gets truncated
+    if (stat(outputFile, &outputInfo) == 0 && (!S_ISREG(outputInfo.st_mode)
+            || (outputInfo.st_dev == inputInfo.st_dev && outputInfo.st_ino == inputInfo.st_ino))) {
+        close(inputFD);
+        shellStats.fastcopyDeclined++;
+        return 0;
+    }
+
+    outputFD = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (outputFD == -1) {
+        perror("output file open()");
+        close(inputFD);
+        status = EXIT_FAILURE << 8; // Same as a child that exited with 1
+        return 1;
+    }
+
+    // SIGINT would have killed cat, so let it stop the copy
+    shellInterrupted = 0;
+    copyAction.sa_handler = catchShellSIGINT;
+    sigaction(SIGINT, &copyAction, &oldAction);
+
+    result = fastcopy_copy(inputFD, outputFD);
+
+    sigaction(SIGINT, &oldAction, NULL);
+    close(inputFD);
+    close(outputFD);
+    shellStats.fastcopyTaken++;
+
+    if (shellInterrupted) {
+        status = SIGINT; // Same as a child terminated by SIGINT
+        printf("terminated by signal %d\n", status);
+        fflush(stdout);
+    } else if (result == -1) {
+        perror("cat");
+        status = EXIT_FAILURE << 8;
+    } else {
+        status = 0;
+    }
+    return 1;
+}
+
+// Adds a descriptor for launch_spawn()/launch_fork() to set up in the
+// child, parentFD gets dup2()ed onto childFD. shellOwned means the shell
+// opened parentFD for this launch and closes it afterwards.
+void launch_add_fd(struct launch_spec *spec, int parentFD, int childFD, int shellOwned)
+{
+    spec->fds[spec->numFds].parentFD = parentFD;
+    spec->fds[spec->numFds].childFD = childFD;
+    spec->fds[spec->numFds].shellOwned = shellOwned;
+    spec->numFds++;
+}
+
+// Writes all of a buffer, going on after short writes. Returns -1 on error.
+int write_all(int fd, const char *buffer, size_t length)
+{
+    ssize_t written;
+
+    while (length > 0) {
+        written = write(fd, buffer, length);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        }
+        if (written == -1) {
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Gives a heredoc or here-string body to the command as a descriptor to
+// read from, close-on-exec like the redirection files. A body that fits
+// in a pipe is written into one, and the command reads it from the other
+// end. Bigger ones are written into a memfd, which is rewound so the
+// command reads it from the start (and can seek in it, like a file).
+// Returns the descriptor or -1.
+int heredoc_open(struct redirection *redir)
+{
+    const char *body = redir->target;
+    size_t length = strlen(body);
+    int newline = redir->type == REDIR_HERESTRING;
+    int pipeFDs[2], fd;
+
+    if (length + newline <= HEREDOC_PIPE_MAX && pipe2(pipeFDs, O_CLOEXEC) == 0) {
+        // The pipe can be smaller than usual when the user has many
+        if (length + newline <= (size_t)fcntl(pipeFDs[1], F_GETPIPE_SZ)
+                && write_all(pipeFDs[1], body, length) == 0
+                && (!newline || write_all(pipeFDs[1], "\n", 1) == 0)) {
+            close(pipeFDs[1]);
+            return pipeFDs[0];
+        }
+        close(pipeFDs[0]);
+        close(pipeFDs[1]);
+    }
+
+    fd = memfd_create("smallsh-heredoc", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (write_all(fd, body, length) == -1 || (newline && write_all(fd, "\n", 1) == -1)
+            || lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Opens a redirection's file, close-on-exec, applying any iotune
+// settings. Returns the descriptor or -1.
+int redirect_open(struct redirection *redir)
+{
+    struct stat info;
+    int fd, flags;
+
+    if (redir->type == REDIR_HEREDOC || redir->type == REDIR_HERESTRING) {
+        return heredoc_open(redir);
+    }
+    if (redir->type == REDIR_IN) {
+        flags = O_RDONLY;
+    } else if (redir->type == REDIR_APPEND) {
+        flags = O_WRONLY | O_CREAT | O_APPEND | ioTune.outputFlags;
+    } else {
+        flags = O_WRONLY | O_CREAT | O_TRUNC | ioTune.outputFlags;
+    }
+    fd = open(redir->target, flags | O_CLOEXEC, 0644);
+    if (fd == -1 || !ioTune.active) {
+        return fd;
+    }
+
+    // Read ahead hints are kept on the open file, which the child shares
+    if (redir->type == REDIR_IN && ioTune.advice != -1) {
+        posix_fadvise(fd, 0, 0, ioTune.advice);
+    }
+    // Reserve the space up front so a long write isn't spread over many
+    // extents. The file's size stays as it is, from the end for >>.
+    // File systems without fallocate() just go without.
+    if (redir->type != REDIR_IN && ioTune.preallocate > 0
+            && fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, redir->type == REDIR_APPEND ? info.st_size : 0,
+                ioTune.preallocate);
+    }
+    return fd;
+}
+
+// Works out a stage's descriptors: the pipes it reads from and writes to
+// (-1 if none), then its redirections in order, so a redirection wins over
+// the pipe. Redirection files are opened close-on-exec, the dup2() onto
+// the target descriptor in the child is what survives the exec.
+// Background jobs get /dev/null on stdin of their first stage and stdout
+// of their last when not redirected.
+// Returns -1 if a file can't be opened.
+int launch_open_redirects(struct command *stage, struct launch_spec *spec,
+        int stageIn, int stageOut, int nullIn, int nullOut)
+{
+    struct redirection *redir;
+    int i, fd, maxChildFD = 1, hasIn = 0, hasOut = 0;
+
+    spec->fds = arena_alloc(&shellArena, (stage->numRedirs + 4) * sizeof(struct fd_action));
+    spec->numFds = 0;
+
+    if (stageIn != -1) launch_add_fd(spec, stageIn, 0, 0);
+    if (stageOut != -1) launch_add_fd(spec, stageOut, 1, 0);
+
+    for (i = 0; i < stage->numRedirs; i++) {
+        redir = &stage->redirs[i];
+        if (redir->type == REDIR_DUP_IN || redir->type == REDIR_DUP_OUT) {
+            if (launch_add_dup(spec, atoi(redir->target), redir->fd) == -1) {
+                fprintf(stderr, "smallsh: %s: %s\n", redir->target, strerror(errno));
+                launch_close_redirects(spec);
+                return -1;
+            }
+            if (redir->fd == 0) hasIn = 1;
+            if (redir->fd == 1) hasOut = 1;
+            if (redir->fd > maxChildFD) maxChildFD = redir->fd;
+            continue;
+        }
+        fd = redirect_open(redir);
+        // Error opening file
+        if (fd == -1) {
+            perror(redir->type == REDIR_OUT || redir->type == REDIR_APPEND
+                    ? "output file open()" : "input file open()");
+            launch_close_redirects(spec);
+            return -1;
+        }
+        launch_add_fd(spec, fd, redir->fd, 1);
+        if (redir->fd == 0) hasIn = 1;
+        if (redir->fd == 1) hasOut = 1;
+        if (redir->fd > maxChildFD) maxChildFD = redir->fd;
+    }
+
+    // Direct /dev/null to STDIN and from STDOUT for background jobs
+    if (nullIn && !hasIn) {
+        fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd == -1) { perror("input file open()"); launch_close_redirects(spec); return -1; }
+        launch_add_fd(spec, fd, 0, 1);
+    }
+    if (nullOut && !hasOut) {
+        fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (fd == -1) { perror("output file open()"); launch_close_redirects(spec); return -1; }
+        launch_add_fd(spec, fd, 1, 1);
+    }
+
+    // Redirecting descriptors above 2 could land on a descriptor another
+    // dup2() still needs, move the shell's copies out of the way first.
+    // Later actions copying the same descriptor follow it.
+    for (i = 0; maxChildFD > 2 && i < spec->numFds; i++) {
+        if (spec->fds[i].parentFD <= maxChildFD) {
+            int old = spec->fds[i].parentFD, j;
+            fd = fcntl(old, F_DUPFD_CLOEXEC, maxChildFD + 1);
+            if (fd == -1) { perror("smallsh"); launch_close_redirects(spec); return -1; }
+            for (j = i + 1; j < spec->numFds; j++) {
+                if (spec->fds[j].parentFD == old) {
+                    spec->fds[j].parentFD = fd;
+                    spec->fds[j].shellOwned = 0;
+                }
+            }
+            if (spec->fds[i].shellOwned) close(old);
+            spec->fds[i].parentFD = fd;
+            spec->fds[i].shellOwned = 1;
+        }
+    }
+    return 0;
+}
+
+// Adds a N>&M style copy to a launch. The child's descriptor becomes
+// whatever its descriptor from is at that point: set up by an earlier
+// redirection or pipe of the same command, or else the shell's own.
+// Returns -1 if from isn't open.
+int launch_add_dup(struct launch_spec *spec, int from, int childFD)
+{
+    int i;
+
+    for (i = spec->numFds - 1; i >= 0; i--) {
+        if (spec->fds[i].childFD == from) {
+            launch_add_fd(spec, spec->fds[i].parentFD, childFD, 0);
+            return 0;
+        }
+    }
+    if (fcntl(from, F_GETFD) == -1) {
+        return -1;
+    }
+    launch_add_fd(spec, from, childFD, 0);
+    return 0;
+}
+
+// Closes the files the shell opened for a launch
+void launch_close_redirects(struct launch_spec *spec)
+{
+    int i;
+
+    for (i = 0; i < spec->numFds; i++) {
+        if (spec->fds[i].shellOwned) {
+            close(spec->fds[i].parentFD);
+        }
+    }
+    spec->numFds = 0;
+}
+
+// Arguments running a file that has no #! line through /bin/sh, like
+// execvp() does when exec fails with ENOEXEC: /bin/sh path args...
+// shArgv needs room for two more entries than argv has.
+void launch_sh_argv(char **shArgv, const char *path, char **argv)
+{
+    int i;
+
+    shArgv[0] = "/bin/sh";
+    shArgv[1] = (char *)path;
+    for (i = 1; argv[i - 1] != NULL && argv[i] != NULL; i++) {
+        shArgv[i + 1] = argv[i];
+    }
+    shArgv[i + 1] = NULL;
+}
+
+// execv() in a child, falling back to /bin/sh for scripts without #!.
+// Only returns if neither could be run, with errno from the first try.
+void launch_exec(const char *path, char **argv)
+{
+    int argc;
+
+    execv(path, argv);
+    if (errno != ENOEXEC) {
+        return;
+    }
+    for (argc = 0; argv[argc] != NULL; argc++);
+    char *shArgv[argc + 2];
+    launch_sh_argv(shArgv, path, argv);
+    execv(shArgv[0], shArgv);
+    errno = ENOEXEC;
+}
+
+// Launches a command with posix_spawn(). The child setup from the fork
+// path is expressed as file actions (the dup2() redirections) and spawn
+// attributes (SIGINT back to default for foreground processes).
+// Returns the child's pid, or -1 if the command couldn't be started.
+pid_t launch_spawn(struct launch_spec *spec)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t blockMask, oldMask, defaultSignals;
+    struct sigaction ignoreAction = {0}, oldTSTPAction;
+    pid_t pid = -1;
+    int err, i;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // Redirect descriptors to the pipes and files opened earlier
+    for (i = 0; i < spec->numFds; i++) {
+        posix_spawn_file_actions_adddup2(&actions, spec->fds[i].parentFD, spec->fds[i].childFD);
+    }
+
+    // Change SIGINT back to default action for foreground processes
+    // Background processes will continue to ignore SIGINT
+    sigemptyset(&defaultSignals);
+    if (!spec->background) {
+        sigaddset(&defaultSignals, SIGINT);
+    }
+    // The shell ignores SIGTTOU, children shouldn't
+    sigaddset(&defaultSignals, SIGTTOU);
+    sigaddset(&defaultSignals, SIGTTIN);
+
+    // SIGTSTP should be ignored in the child, but spawn attributes can only
+    // reset signals to default. Ignored signals stay ignored across exec,
+    // so ignore SIGTSTP in the shell (with it blocked) for the spawn itself.
+    // With job control it is just reset to default in the child.
+    sigemptyset(&blockMask);
+    sigaddset(&blockMask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &blockMask, &oldMask);
+    if (spec->jobControl) {
+        sigaddset(&defaultSignals, SIGTSTP);
+        sigaction(SIGTSTP, NULL, &oldTSTPAction);
+    } else {
+        ignoreAction.sa_handler = SIG_IGN;
+        sigaction(SIGTSTP, &ignoreAction, &oldTSTPAction);
+    }
+
+    // Child starts with the signal mask the shell started with
+    posix_spawnattr_setsigdefault(&attr, &defaultSignals);
+    posix_spawnattr_setsigmask(&attr, &childMask);
+    // Put the child in the job's process group
+    posix_spawnattr_setpgroup(&attr, spec->pgid == -1 ? 0 : spec->pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK
+            | (spec->pgid != -1 ? POSIX_SPAWN_SETPGROUP : 0));
+
+    err = posix_spawn(&pid, spec->path, &actions, &attr, spec->argv, environ);
+    // posix_spawn() doesn't run scripts without #! itself, unlike execvp()
+    if (err == ENOEXEC) {
+        int argc;
+        for (argc = 0; spec->argv[argc] != NULL; argc++);
+        char *shArgv[argc + 2];
+        launch_sh_argv(shArgv, spec->path, spec->argv);
+        if (posix_spawn(&pid, shArgv[0], &actions, &attr, shArgv, environ) != 0) {
+            pid = -1;
+        } else {
+            err = 0;
+        }
+    }
+
+    // Restore the SIGTSTP handler, any SIGTSTP that came in meanwhile
+    // is delivered once it is unblocked
+    sigaction(SIGTSTP, &oldTSTPAction, NULL);
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err == ENOSYS) {
+        // No usable posix_spawn() at run time, fall back to fork for good
+        launchEngine = LAUNCH_FORK;
+        return launch_fork(spec);
+    }
+    if (err != 0) {
+        errno = err;
+        perror("smallsh");
+        status = EXIT_FAILURE << 8; // Same as a child that failed to exec
+        return -1;
+    }
+    return pid;
+}
+
+// Launches a command with fork() and execv()
+// Returns the child's pid, or -1 if fork failed.
+pid_t launch_fork(struct launch_spec *spec)
+{
+    pid_t pid = spec->cgroupFD != -1 ? cgroup_fork(spec->cgroupFD) : fork();
+    int i;
+
+    if (pid == 0) { // Now inside the child process
+        // Change SIGTSTP to ignore for child processes, unless they
+        // can be stopped with job control
+        SIGTSTP_action.sa_handler = spec->jobControl ? SIG_DFL : SIG_IGN;
+        sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        // Change SIGINT back to default action for foreground processes
+        // Background processes will continue to ignore SIGINT
+        if(!spec->background) {
+            SIGINT_action.sa_handler = SIG_DFL;
+            sigaction(SIGINT, &SIGINT_action, NULL);
+        }
+
+        // Undo the shell's blocking of SIGCHLD
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        // Join the job's process group
+        if (spec->pgid != -1) {
+            setpgid(0, spec->pgid);
+        }
+
+        // Redirect descriptors to the pipes and files opened earlier
+        for (i = 0; i < spec->numFds; i++) {
+            if (spec->fds[i].parentFD == spec->fds[i].childFD) {
+                // N>&N keeps the shell's descriptor, dup2() wouldn't clear close-on-exec
+                fcntl(spec->fds[i].childFD, F_SETFD, 0);
+            } else {
+                dup2(spec->fds[i].parentFD, spec->fds[i].childFD);
+            }
+        }
+        // Limits and placement from limit and pin
+        if (launchAttrs.active && launch_apply_attrs() == -1) {
+            exit(EXIT_FAILURE);
+        }
+
+        // Pass args to execv() and check for error
+        launch_exec(spec->path, spec->argv);
+        perror("smallsh");
+        // Should only reach if execv fails
+        exit(EXIT_FAILURE);
+
+    } else if (pid < 0) {  // Error forking
+        perror("smallsh");
+    } else if (spec->pgid != -1) {
+        // Also set the group from the parent, whichever runs first wins
+        setpgid(pid, spec->pgid == 0 ? pid : spec->pgid);
+    }
+    return pid;
+}
+
+// Runs in a pool worker after it is forked: waits for a request from
+// the shell, sets up the child the same way launch_fork() does, then
+// execs. Never returns.
+void pool_worker_main(int sock)
+{
+    static char message[POOL_MESSAGE_SIZE];
+    char control[CMSG_SPACE(POOL_MAX_FDS * sizeof(int))];
+    struct pool_request *request = (struct pool_request *)message;
+    struct iovec iov = { message, sizeof(message) - 1 };
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    int fds[POOL_MAX_FDS];
+    char **argv, *p;
+    ssize_t length;
+    int i;
+
+    // Die with the shell instead of waiting forever
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() == 1) _exit(0);
+
+    // Other workers' sockets were inherited too, they aren't ours. Nor
+    // are the coprocess pipes, holding them would hide the shell closing
+    // its end.
+    for (i = 0; i < poolIdle; i++) {
+        close(poolWorkers[i].socket);
+    }
+    if (coprocRead != -1) close(coprocRead);
+    if (coprocWrite != -1) close(coprocWrite);
+    // Nor the agent connections, the agent would miss the shell exiting
+    for (i = 0; i < numRemoteHosts; i++) {
+        if (remoteHosts[i].fd != -1) close(remoteHosts[i].fd);
+    }
+
+    // Child signal setup, done before any request comes in
+    SIGTSTP_action.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do {
+        length = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (length == -1 && errno == EINTR);
+    // The shell closed the socket or sent something unusable
+    if (length < (ssize_t)sizeof(struct pool_request)) {
+        _exit(0);
+    }
+    message[length] = '\0';
+    close(sock);
+
+    // Descriptors from the shell, moved up so the dup2()s below can't
+    // overwrite one that is still needed
+    cmsg = CMSG_FIRSTHDR(&msg);
+    for (i = 0; i < request->numFds; i++) {
+        memcpy(&fds[i], CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+        int moved = fcntl(fds[i], F_DUPFD_CLOEXEC, 100);
+        close(fds[i]);
+        fds[i] = moved;
+    }
+
+    // Change SIGINT back to default action for foreground processes
+    if (!request->background) {
+        SIGINT_action.sa_handler = SIG_DFL;
+        sigaction(SIGINT, &SIGINT_action, NULL);
+    }
+    if (request->jobControl) {
+        signal(SIGTSTP, SIG_DFL);
+    }
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
+
+    for (i = 0; i < request->numFds; i++) {
+        dup2(fds[i], request->childFDs[i]);
+    }
+
+    // Unpack the path and argument strings following the request
+    argv = (char **)malloc((request->argc + 1) * sizeof(char *));
+    p = message + sizeof(struct pool_request);
+    char *path = p;
+    p += strlen(p) + 1;
+    for (i = 0; i < request->argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[request->argc] = NULL;
+
+    launch_exec(path, argv);
+    perror("smallsh");
+    _exit(EXIT_FAILURE);
+}
+
+// Forks idle workers until the pool is full again
+void pool_refill(void)
+{
+    int sockets[2];
+    pid_t pid;
+
+    while (poolIdle < poolSize) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+            perror("smallsh: pool");
+            return;
+        }
+        pid = fork();
+        if (pid == 0) {
+            close(sockets[0]);
+            pool_worker_main(sockets[1]);
+        }
+        close(sockets[1]);
+        if (pid < 0) {
+            perror("smallsh: pool");
+            close(sockets[0]);
+            return;
+        }
+        poolWorkers[poolIdle].pid = pid;
+        poolWorkers[poolIdle].socket = sockets[0];
+        poolWorkers[poolIdle].generation = poolGeneration;
+        poolIdle++;
+    }
+}
+
+// Changes how many idle workers the pool keeps, stopping any extra ones
+void pool_resize(int size)
+{
+    while (poolIdle > size) {
+        poolIdle--;
+        kill(poolWorkers[poolIdle].pid, SIGKILL);
+        close(poolWorkers[poolIdle].socket);
+    }
+    poolWorkers = realloc(poolWorkers, (size + 1) * sizeof(struct pool_worker));
+    if (!poolWorkers) {
+        fprintf(stderr, "smallsh: allocation error for pool\n");
+        exit(EXIT_FAILURE);
+    }
+    poolSize = size;
+}
+
+// Hands a launch to an idle pool worker. Returns the worker's pid, which
+// is now the command's process, or -1 if no worker could take it (the
+// caller then launches the usual way).
+pid_t pool_launch(struct launch_spec *spec)
+{
+    static char message[POOL_MESSAGE_SIZE];
+    char control[CMSG_SPACE(POOL_MAX_FDS * sizeof(int))] = {0};
+    struct pool_request *request = (struct pool_request *)message;
+    struct pool_worker worker;
+    struct iovec iov;
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+    size_t length, used;
+    int i;
+
+    if (spec->numFds > POOL_MAX_FDS) {
+        return -1;
+    }
+
+    // Pack the path and argv after the request header
+    request->background = spec->background;
+    request->jobControl = spec->jobControl;
+    request->numFds = spec->numFds;
+    used = sizeof(struct pool_request);
+    length = strlen(spec->path) + 1;
+    if (used + length > sizeof(message)) return -1;
+    memcpy(message + used, spec->path, length);
+    used += length;
+    for (i = 0; spec->argv[i] != NULL; i++) {
+        length = strlen(spec->argv[i]) + 1;
+        // Too big for one message, launch the usual way
+        if (used + length > sizeof(message)) return -1;
+        memcpy(message + used, spec->argv[i], length);
+        used += length;
+    }
+    request->argc = i;
+
+    iov.iov_base = message;
+    iov.iov_len = used;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (spec->numFds > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(spec->numFds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(spec->numFds * sizeof(int));
+        for (i = 0; i < spec->numFds; i++) {
+            request->childFDs[i] = spec->fds[i].childFD;
+            memcpy(CMSG_DATA(cmsg) + i * sizeof(int), &spec->fds[i].parentFD, sizeof(int));
+        }
+    }
+
+    while (poolIdle > 0) {
+        worker = poolWorkers[--poolIdle];
+        // Forked before the shell's state changed, or gone, drop it
+        if (worker.generation != poolGeneration) {
+            kill(worker.pid, SIGKILL);
+            close(worker.socket);
+            continue;
+        }
+        // Put it in the job's process group before it can exec
+        if (spec->pgid != -1) {
+            setpgid(worker.pid, spec->pgid == 0 ? worker.pid : spec->pgid);
+        }
+        if (sendmsg(worker.socket, &msg, MSG_NOSIGNAL) == (ssize_t)used) {
+            close(worker.socket);
+            shellStats.poolLaunches++;
+            return worker.pid;
+        }
+        kill(worker.pid, SIGKILL);
+        close(worker.socket);
+    }
+    return -1;
+}
+
+// Opens the trace file for appending. Records are written whole with a
+// single write() to an O_APPEND descriptor, so they don't interleave
+// even if several shells trace to the same file.
+void trace_open(const char *file)
+{
+    traceFD = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (traceFD == -1) {
+        fprintf(stderr, "smallsh: trace: %s: %s\n", file, strerror(errno));
+    }
+}
+
+// Writes a string as a JSON string literal
+void trace_string(FILE *out, const char *text)
+{
+    const unsigned char *c;
+
+    fputc('"', out);
+    for (c = (const unsigned char *)text; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        }
+        else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        }
+        else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Describes each stage of a command, its argv and redirections, as the
+// JSON array stored with the job for its trace record. Returns a
+// malloc()ed string.
+char *trace_describe(struct command *command)
+{
+    static const char *redirOps[] = { "<", ">", ">>", "<&", ">&", "<<", "<<<" };
+    struct command *stage;
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out;
+    int i;
+
+    out = open_memstream(&text, &length);
+    if (out == NULL) {
+        fprintf(stderr, "smallsh: allocation error for trace\n");
+        exit(EXIT_FAILURE);
+    }
+    fputc('[', out);
+    for (stage = command; stage != NULL; stage = stage->next) {
+        if (stage != command) fputc(',', out);
+        fputs("{\"argv\":[", out);
+        for (i = 0; i < stage->argc; i++) {
+            if (i > 0) fputc(',', out);
+            trace_string(out, stage->argv[i]);
+        }
+        fputs("],\"redirs\":[", out);
+        for (i = 0; i < stage->numRedirs; i++) {
+            if (i > 0) fputc(',', out);
+            fprintf(out, "{\"fd\":%d,\"op\":\"%s\",\"target\":",
+                    stage->redirs[i].fd, redirOps[stage->redirs[i].type]);
+            trace_string(out, stage->redirs[i].target);
+            fputc('}', out);
+        }
+        fputs("]}", out);
+    }
+    fputc(']', out);
+    fclose(out);
+    return text;
+}
+
+// Appends a finished job's record to the trace file:
+//   {"ts":..., "pid":..., "bg":..., "stages":[...], "launch_us":...,
+//    "wall_us":..., "exit":..., "signal":...}
+// exit is null for a job killed by a signal, signal is 0 otherwise. The
+// record is formatted in memory first and written with one write().
+void trace_job(struct job *job)
+{
+    char *record = NULL;
+    size_t length = 0;
+    long wallUs;
+    FILE *out;
+
+    // Jobs that never got going weren't reaped, they end now
+    if (job->state != JOB_DONE) {
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+        job->status = job_final_status(job);
+    }
+    wallUs = (job->end.tv_sec - job->start.tv_sec) * 1000000L
+           + (job->end.tv_nsec - job->start.tv_nsec) / 1000;
+
+    out = open_memstream(&record, &length);
+    if (out == NULL) {
+        fprintf(stderr, "smallsh: allocation error for trace\n");
+        exit(EXIT_FAILURE);
+    }
+    fprintf(out, "{\"ts\":%ld.%06ld,\"pid\":%d,\"bg\":%s,\"stages\":%s,"
+            "\"launch_us\":%ld,\"wall_us\":%ld,",
+            (long)job->launched.tv_sec, job->launched.tv_nsec / 1000,
+            job->numProcs > 0 ? (int)job->procs[0].pid : 0,
+            job->background ? "true" : "false", job->trace,
+            job->launchNs / 1000, wallUs);
+    if (WIFSIGNALED(job->status)) {
+        fprintf(out, "\"exit\":null,\"signal\":%d}\n", WTERMSIG(job->status));
+    }
+    else {
+        fprintf(out, "\"exit\":%d,\"signal\":0}\n", WEXITSTATUS(job->status));
+    }
+    fclose(out);
+
+    event_write(traceFD, record, length);
+}
+
+// Hash function for command names in the PATH cache (djb2)
+unsigned int path_hash(const char *name)
+{
+    unsigned int hash = 5381;
+    while (*name) {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash % PATH_CACHE_BUCKETS;
+}
+
+// Empties the PATH cache
+void path_cache_clear(void)
+{
+    int i;
+    struct path_entry *entry, *next;
+
+    for (i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (entry = pathCache[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        pathCache[i] = NULL;
+    }
+    free(pathCacheKey);
+    pathCacheKey = NULL;
+    free(pathDirs);
+    pathDirs = NULL;
+    numPathDirs = 0;
+}
+
+// Splits PATH into pathDirs, kept until PATH changes
+void path_dirs_load(void)
+{
+    const char *path = getenv("PATH");
+    const char *dir, *end;
+    int i;
+
+    // Default search path used by execvp() when PATH isn't set
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+    pathCacheKey = strdup(path);
+    numPathDirs = 1;
+    for (dir = path; (dir = strchr(dir, ':')) != NULL; dir++) {
+        numPathDirs++;
+    }
+    pathDirs = malloc(numPathDirs * sizeof(struct path_dir));
+    if (!pathCacheKey || !pathDirs) {
+        fprintf(stderr, "smallsh: allocation error for path cache\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0, dir = pathCacheKey; i < numPathDirs; i++, dir = end + 1) {
+        end = strchr(dir, ':');
+        if (end == NULL) {
+            end = dir + strlen(dir);
+        }
+        pathDirs[i].dir = dir;
+        pathDirs[i].length = end - dir;
+    }
+}
+
+// Walks each PATH directory looking for an executable called name,
+// the same search execvp() does. On success the full path is stored
+// in result and the binary's stat() info in info.
+int path_search(const char *name, char *result, size_t size, struct stat *info)
+{
+    int sawDenied = 0;
+    int i;
+
+    for (i = 0; i < numPathDirs; i++) {
+        // An empty PATH entry means the current directory
+        if (pathDirs[i].length == 0) {
+            snprintf(result, size, "%s", name);
+        } else {
+            snprintf(result, size, "%.*s/%s", pathDirs[i].length, pathDirs[i].dir, name);
+        }
+
+        if (stat(result, info) == 0 && S_ISREG(info->st_mode)) {
+            if (access(result, X_OK) == 0) {
+                return 0;
+            }
+            sawDenied = 1;
+        }
+    }
+
+    // Report errors the same way execvp() would
+    errno = sawDenied ? EACCES : ENOENT;
+    return -1;
+}
+
+// Looks up where a command lives, using the PATH cache. The cache is
+// thrown out when PATH is changed by export or unset, and an entry is
+// dropped if its binary was removed or modified since it was cached.
+// Returns the full path, or NULL (with errno set) if not found.
+const char *path_lookup(const char *name)
+{
+    char fullPath[4096];
+    struct stat info;
+    struct path_entry *entry, **link;
+    unsigned int bucket;
+
+    if (pathCacheKey == NULL) {
+        path_dirs_load();
+    }
+
+    bucket = path_hash(name);
+    for (link = &pathCache[bucket]; (entry = *link) != NULL; link = &entry->next) {
+        if (strcmp(entry->name, name) != 0) {
+            continue;
+        }
+        // Make sure the cached binary is still there and unchanged
+        if (stat(entry->path, &info) == 0
+                && info.st_mtim.tv_sec == entry->mtime.tv_sec
+                && info.st_mtim.tv_nsec == entry->mtime.tv_nsec) {
+            entry->hits++;
+            shellStats.pathHits++;
+            return entry->path;
+        }
+        // Stale, remove it and search again below
+        *link = entry->next;
+        free(entry->name);
+        free(entry->path);
+        free(entry);
+        break;
+    }
+
+    shellStats.pathMisses++;
+    if (path_search(name, fullPath, sizeof(fullPath), &info) == -1) {
+        return NULL;
+    }
+
+    // Add the new location to the cache
+    entry = malloc(sizeof(struct path_entry));
+    if (!entry) {
+        fprintf(stderr, "smallsh: allocation error for path cache\n");
+        exit(EXIT_FAILURE);
+    }
+    entry->name = strdup(name);
+    entry->path = strdup(fullPath);
+    entry->mtime = info.st_mtim;
+    entry->hits = 1;
+    entry->next = pathCache[bucket];
+    pathCache[bucket] = entry;
+    return entry->path;
+}
+
+// Returns $HOME, looked up once until export or unset changes it
+const char *shell_home(void)
+{
+    if (!homeLoaded) {
+        homeDir = getenv("HOME");
+        homeLoaded = 1;
+    }
+    return homeDir;
+}
+
+// Drops what was taken from an environment variable that export or
+// unset just changed
+void env_changed(const char *name)
+{
+    if (strcmp(name, "PATH") == 0) {
+        path_cache_clear();
+    } else if (strcmp(name, "HOME") == 0) {
+        homeLoaded = 0;
+    }
+    // Pool workers were forked with the old environment
+    poolGeneration++;
+}
+
+// Ends a part of startup, recording how long it took since the last one
+void startup_mark(const char *phase)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (numStartupPhases < STARTUP_MAX_PHASES) {
+        startupPhases[numStartupPhases].name = phase;
+        startupPhases[numStartupPhases].ns = (now.tv_sec - startupLast.tv_sec) * 1000000000L
+                + (now.tv_nsec - startupLast.tv_nsec);
+        numStartupPhases++;
+    }
+    startupLast = now;
+}
+
+// Hash function for the pid index
+unsigned int pid_hash(pid_t pid)
+{
+    return (unsigned int)pid * 2654435761u;
+}
+
+// Finds the job a process belongs to, or -1 if it isn't tracked.
+// Called from the SIGCHLD handler, so it must not change anything.
+int job_find_pid(pid_t pid)
+{
+    unsigned int mask = pidIndexSize - 1;
+    unsigned int i;
+
+    if (pidIndexSize == 0) {
+        return -1;
+    }
+    for (i = pid_hash(pid) & mask; pidIndex[i].pid != 0; i = (i + 1) & mask) {
+        if (pidIndex[i].pid == pid) {
+            return pidIndex[i].job;
+        }
+    }
+    return -1;
+}
+
+// Adds a pid to the pid index, growing it to keep it at most half full
+void pid_index_insert(pid_t pid, int job)
+{
+    struct pid_slot *old = pidIndex;
+    int oldSize = pidIndexSize;
+    unsigned int mask, i;
+    int j;
+
+    if ((pidIndexCount + 1) * 2 > pidIndexSize) {
+        pidIndexSize = pidIndexSize ? pidIndexSize * 2 : 64;
+        pidIndex = calloc(pidIndexSize, sizeof(struct pid_slot));
+        if (!pidIndex) {
+            fprintf(stderr, "smallsh: allocation error for job table\n");
+            exit(EXIT_FAILURE);
+        }
+        // Rehash everything into the bigger table
+        mask = pidIndexSize - 1;
+        for (j = 0; j < oldSize; j++) {
+            if (old[j].pid != 0) {
+                for (i = pid_hash(old[j].pid) & mask; pidIndex[i].pid != 0; i = (i + 1) & mask);
+                pidIndex[i] = old[j];
+            }
+        }
+        free(old);
+    }
+
+    mask = pidIndexSize - 1;
+    for (i = pid_hash(pid) & mask; pidIndex[i].pid != 0; i = (i + 1) & mask);
+    pidIndex[i].pid = pid;
+    pidIndex[i].job = job;
+    pidIndexCount++;
+}
+
+// Removes a pid from the pid index. Entries after it are shifted back
+// so lookups never need tombstones.
+void pid_index_remove(pid_t pid)
+{
+    unsigned int mask = pidIndexSize - 1;
+    unsigned int i, j, home;
+
+    for (i = pid_hash(pid) & mask; pidIndex[i].pid != pid; i = (i + 1) & mask) {
+        if (pidIndex[i].pid == 0) {
+            return;
+        }
+    }
+
+    for (j = (i + 1) & mask; pidIndex[j].pid != 0; j = (j + 1) & mask) {
+        home = pid_hash(pidIndex[j].pid) & mask;
+        // Move the entry into the hole if the hole lies between
+        // its home slot and where it sits now
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            pidIndex[i] = pidIndex[j];
+            i = j;
+        }
+    }
+    pidIndex[i].pid = 0;
+    pidIndexCount--;
+}
+
+// Takes a slot from the job table for a newly launched command and puts
+// it on the live list. Returns the job's index.
+int job_create(struct command *command, int background)
+{
+    struct job *job;
+    struct command *stage;
+    int index, i;
+    size_t length = 0;
+    char *end;
+
+    // Grow the slab when the free list is empty
+    if (jobFree == -1) {
+        int oldCapacity = jobCapacity;
+        jobCapacity = jobCapacity ? jobCapacity * 2 : 16;
+        jobTable = realloc(jobTable, jobCapacity * sizeof(struct job));
+        if (!jobTable) {
+            fprintf(stderr, "smallsh: allocation error for job table\n");
+            exit(EXIT_FAILURE);
+        }
+        // Chain the new slots onto the free list, lowest first
+        for (i = jobCapacity - 1; i >= oldCapacity; i--) {
+            jobTable[i].state = JOB_FREE;
+            jobTable[i].next = jobFree;
+            jobFree = i;
+        }
+    }
+
+    index = jobFree;
+    job = &jobTable[index];
+    jobFree = job->next;
+    if (++shellStats.jobsLive > shellStats.jobsPeak) {
+        shellStats.jobsPeak = shellStats.jobsLive;
+    }
+
+    job->state = JOB_RUNNING;
+    job->background = background;
+    job->pgid = 0;
+    job->procs = NULL;
+    job->numProcs = 0;
+    job->numLive = 0;
+    job->numStopped = 0;
+    job->stopSignal = 0;
+    job->ownGroup = background;
+    job->status = 0;
+    job->nextDone = -1;
+    job->timed = command->timed;
+    memset(&job->usage, 0, sizeof(job->usage));
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->launchNs = 0;
+    job->trace = NULL;
+    job->cgroupFD = -1;
+    job->remoteHost = -1;
+    if (cgroups) {
+        cgroup_job_create(job, index);
+    }
+    // The command's argv is gone by the time the job ends, keep it as JSON
+    if (traceFD != -1) {
+        clock_gettime(CLOCK_REALTIME, &job->launched);
+        job->trace = trace_describe(command);
+    }
+
+    // Join the arguments of each stage back into the command text
+    for (stage = command; stage != NULL; stage = stage->next) {
+        for (i = 0; i < stage->argc; i++) {
+            length += strlen(stage->argv[i]) + 1;
+        }
+        length += 2;
+    }
+    job->command = malloc(length + 1);
+    if (!job->command) {
+        fprintf(stderr, "smallsh: allocation error for job table\n");
+        exit(EXIT_FAILURE);
+    }
+    // Copy along with stpcpy(), strcat() would go quadratic on long globs
+    end = job->command;
+    *end = '\0';
+    for (stage = command; stage != NULL; stage = stage->next) {
+        if (stage != command) end = stpcpy(end, " | ");
+        for (i = 0; i < stage->argc; i++) {
+            if (i > 0) end = stpcpy(end, " ");
+            end = stpcpy(end, stage->argv[i]);
+        }
+    }
+
+    // Push onto the live list
+    job->prev = -1;
+    job->next = jobLive;
+    if (jobLive != -1) {
+        jobTable[jobLive].prev = index;
+    }
+    jobLive = index;
+
+    return index;
+}
+
+// Records a launched process as the next stage of a job. A pid of 0
+// records a stage that couldn't be launched, with the given status.
+void job_add_process(int index, pid_t pid, int failStatus)
+{
+    struct job *job = &jobTable[index];
+
+    job->procs = realloc(job->procs, (job->numProcs + 1) * sizeof(struct job_process));
+    if (!job->procs) {
+        fprintf(stderr, "smallsh: allocation error for job table\n");
+        exit(EXIT_FAILURE);
+    }
+    job->procs[job->numProcs].pid = pid;
+    job->procs[job->numProcs].status = failStatus;
+    job->procs[job->numProcs].stopped = 0;
+    job->numProcs++;
+    if (pid == 0) {
+        return;
+    }
+    job->numLive++;
+    if (job->pgid == 0) {
+        job->pgid = job->ownGroup ? pid : getpgrp();
+    }
+    pid_index_insert(pid, index);
+}
+
+// Works out a finished job's status, that of its last stage. With the
+// pipefail option it is the last stage that failed, if any did.
+int job_final_status(struct job *job)
+{
+    int i;
+
+    if (pipefail) {
+        for (i = job->numProcs - 1; i >= 0; i--) {
+            if (job->procs[i].status != 0) {
+                return job->procs[i].status;
+            }
+        }
+    }
+    return job->procs[job->numProcs - 1].status;
+}
+
+// Returns a finished job's slot to the free list
+void job_release(int index)
+{
+    struct job *job = &jobTable[index];
+    int i;
+
+    // Every job is released once it is over, so this is where it is traced
+    if (job->trace != NULL) {
+        trace_job(job);
+        free(job->trace);
+    }
+    for (i = 0; i < job->numProcs; i++) {
+        if (job->procs[i].pid != 0) {
+            pid_index_remove(job->procs[i].pid);
+        }
+    }
+    free(job->procs);
+    free(job->command);
+    if (job->cgroupFD != -1) {
+        cgroup_job_release(job);
+    }
+    // Files a remote job's output went to, 2>&1 shares one
+    if (job->remoteHost != -1) {
+        if (job->remoteFDs[1] > 2) close(job->remoteFDs[1]);
+        if (job->remoteFDs[2] > 2 && job->remoteFDs[2] != job->remoteFDs[1]) close(job->remoteFDs[2]);
+    }
+
+    // Unlink from the live list
+    if (job->prev != -1) {
+        jobTable[job->prev].next = job->next;
+    } else {
+        jobLive = job->next;
+    }
+    if (job->next != -1) {
+        jobTable[job->next].prev = job->prev;
+    }
+
+    job->state = JOB_FREE;
+    job->next = jobFree;
+    jobFree = index;
+    shellStats.jobsLive--;
+}
+
+// Waits for the foreground job to finish, its status ends up in the
+// status variable. SIGCHLD must already be blocked, it is only let in
+// while suspended so the handler can't miss the exit.
+void foreground_wait(int job)
+{
+    // With job control the job gets the terminal while it runs
+    int terminal = monitor && interactive && jobTable[job].ownGroup;
+    struct timespec before, after;
+    // Ctrl-C doesn't reach a remote job through the terminal, the shell
+    // catches it and sends it on
+    int remote = jobTable[job].remoteHost != -1;
+    struct sigaction remoteAction = {0}, oldAction;
+
+    clock_gettime(CLOCK_MONOTONIC, &before);
+    if (terminal) {
+        tcsetpgrp(STDIN_FILENO, jobTable[job].pgid);
+    }
+    if (remote) {
+        shellInterrupted = 0;
+        remoteAction.sa_handler = catchShellSIGINT;
+        sigaction(SIGINT, &remoteAction, &oldAction);
+    }
+    for (;;) {
+        while (jobTable[job].state == JOB_RUNNING) {
+            if (remote && shellInterrupted) {
+                shellInterrupted = 0;
+                job_signal(&jobTable[job], SIGINT);
+            }
+            shell_suspend();
+        }
+        // It tried the terminal before it was handed over, let it go on
+        if (terminal && jobTable[job].state == JOB_STOPPED
+                && (jobTable[job].stopSignal == SIGTTIN || jobTable[job].stopSignal == SIGTTOU)) {
+            job_signal(&jobTable[job], SIGCONT);
+            jobTable[job].state = JOB_RUNNING;
+            continue;
+        }
+        break;
+    }
+    if (terminal) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    if (remote) {
+        sigaction(SIGINT, &oldAction, NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &after);
+    stats_record(shellStats.waitHistogram, &shellStats.waitNs,
+            (after.tv_sec - before.tv_sec) * 1000000000L + (after.tv_nsec - before.tv_nsec));
+
+    // Stopped with SIGTSTP, it stays around as a background job
+    if (jobTable[job].state == JOB_STOPPED) {
+        jobTable[job].background = 1;
+        jobCurrent = job;
+        status = (128 + jobTable[job].stopSignal) << 8;
+        printf("\n[%d] Stopped\t%s\n", job + 1, jobTable[job].command);
+        fflush(stdout);
+        return;
+    }
+    status = jobTable[job].status;
+    lastUsage = jobTable[job].usage;
+    lastWall = (jobTable[job].end.tv_sec - jobTable[job].start.tv_sec)
+             + (jobTable[job].end.tv_nsec - jobTable[job].start.tv_nsec) / 1e9;
+    foregroundJobs++;
+    job_release(job);
+}
+
+// Adds one process's resource usage to its job's total. CPU times and
+// context switches add up, the peak RSS is the largest of any process.
+// Called from the SIGCHLD handler, so it only does arithmetic.
+void usage_add(struct rusage *total, const struct rusage *usage)
+{
+    total->ru_utime.tv_sec += usage->ru_utime.tv_sec;
+    total->ru_utime.tv_usec += usage->ru_utime.tv_usec;
+    if (total->ru_utime.tv_usec >= 1000000) {
+        total->ru_utime.tv_sec++;
+        total->ru_utime.tv_usec -= 1000000;
+    }
+    total->ru_stime.tv_sec += usage->ru_stime.tv_sec;
+    total->ru_stime.tv_usec += usage->ru_stime.tv_usec;
+    if (total->ru_stime.tv_usec >= 1000000) {
+        total->ru_stime.tv_sec++;
+        total->ru_stime.tv_usec -= 1000000;
+    }
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+// Prints a resource usage line: wall clock, user and system CPU, peak
+// resident set size and voluntary/involuntary context switches
+void usage_report(FILE *out, const struct rusage *usage, double wall)
+{
+    fprintf(out, "real %.3fs user %.3fs sys %.3fs maxrss %ldk ctxsw %ld/%ld\n",
+            wall,
+            usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+            usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+            usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+    fflush(out);
+}
+
+// Signal handler for SIGCHLD, reaps every child that has exited and
+// marks it off in its job. Finished foreground jobs are picked up by
+// foreground_wait(), finished background jobs are pushed on the done
+// list for background_check() to report.
+void catchSIGCHLD(int signo)
+{
+    int savedErrno = errno;
+    int childExitMethod;
+    struct rusage usage;
+    pid_t pid;
+    int index, i;
+    struct job *job;
+
+    // wait4() also hands back what the process used
+    while ((pid = wait4(-1, &childExitMethod, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        index = job_find_pid(pid);
+        if (index == -1) {
+            continue;
+        }
+        job = &jobTable[index];
+        for (i = 0; i < job->numProcs && job->procs[i].pid != pid; i++);
+
+        // Stopped and continued processes are still live, the job is
+        // stopped once all of them are
+        if (WIFSTOPPED(childExitMethod)) {
+            if (!job->procs[i].stopped) {
+                job->procs[i].stopped = 1;
+                job->numStopped++;
+            }
+            job->stopSignal = WSTOPSIG(childExitMethod);
+            if (job->numStopped == job->numLive) {
+                job->state = JOB_STOPPED;
+            }
+            continue;
+        }
+        if (job->procs[i].stopped) {
+            job->procs[i].stopped = 0;
+            job->numStopped--;
+        }
+        if (WIFCONTINUED(childExitMethod)) {
+            job->state = JOB_RUNNING;
+            continue;
+        }
+
+        job_process_done(index, i, childExitMethod, &usage);
+    }
+    errno = savedErrno;
+}
+
+// Marks a job's process as finished, and the job once they all are.
+// Finished background jobs go on the done list for background_check().
+void job_process_done(int index, int i, int waitStatus, const struct rusage *usage)
+{
+    struct job *job = &jobTable[index];
+
+    job->procs[i].status = waitStatus;
+    usage_add(&job->usage, usage);
+    if (--job->numLive == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &job->end);
+        job->status = job_final_status(job);
+        job->state = JOB_DONE;
+        if (job->background) {
+            job->nextDone = jobDoneHead;
+            jobDoneHead = index;
+        }
+    }
+}
+
+// Function to report background jobs that have ended since the
+// last prompt, they were already reaped by the SIGCHLD handler
+int background_check(void){
+    int index, reported = 0;
+    struct job *job;
+    sigset_t saved;
+
+    // Agents have sent something, remote jobs may have finished
+    if (remoteReady) {
+        sigprocmask(SIG_BLOCK, &SIGCHLD_set, &saved);
+        remote_service();
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+    }
+    // Nothing finished, which is most lines, costs no system calls. A job
+    // finishing right after this check is reported next time.
+    if (jobDoneHead == -1) {
+        return 0;
+    }
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, &saved);
+    while ((index = jobDoneHead) != -1) {
+        job = &jobTable[index];
+        jobDoneHead = job->nextDone;
+
+        // Remote jobs have no pid here, they go by job number
+        char who[300];
+        if (job->remoteHost != -1) {
+            snprintf(who, sizeof(who), "job %d on %s", index + 1, remoteHosts[job->remoteHost].name);
+        } else {
+            snprintf(who, sizeof(who), "pid %d", job->pgid);
+        }
+        if(WIFEXITED(job->status)) {
+            // The child process ended normally
+            printf("background %s is done: exit value %d\n", who, WEXITSTATUS(job->status));
+        }
+        else if (WIFSIGNALED(job->status)){
+            // A signal terminated child process
+            printf("background %s is done: terminated by signal %d\n", who, WTERMSIG(job->status));
+        }
+        // Started with the time prefix, say what it used too
+        if (job->timed) {
+            double wall = (job->end.tv_sec - job->start.tv_sec)
+                        + (job->end.tv_nsec - job->start.tv_nsec) / 1e9;
+            printf("background %s used: ", who);
+            usage_report(stdout, &job->usage, wall);
+        }
+        job_release(index);
+        reported++;
+    }
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return reported;
+}
+
+// Function used to cycle through and kill background jobs, each
+// background job's whole process group is killed
+void kill_processes(void){
+    int index;
+
+    for (index = jobLive; index != -1; index = jobTable[index].next) {
+        if (jobTable[index].background && jobTable[index].state != JOB_DONE) {
+            job_signal(&jobTable[index], SIGKILL);
+        }
+    }
+    // Jobs with cgroups are killed whole, whatever left their group
+    cgroup_teardown();
+}
+
+// Sends a signal to every process of a job, through its process group
+// if it has its own. A job in the shell's group (stopped from outside
+// the shell) gets it process by process, the shell must not get it too.
+void job_signal(struct job *job, int signo)
+{
+    int i;
+
+    if (job->remoteHost != -1) {
+        remote_kill(job, signo);
+        return;
+    }
+    if (job->ownGroup) {
+        kill(-job->pgid, signo);
+        return;
+    }
+    for (i = 0; i < job->numProcs; i++) {
+        if (job->procs[i].pid != 0 && job->procs[i].status == 0) {
+            kill(job->procs[i].pid, signo);
+        }
+    }
+}
+
+// Finds the cgroup v2 directory the shell is in, from its entry in
+// /proc/self/cgroup and where the cgroup2 file system is mounted.
+// Returns -1 if there is no cgroup v2 hierarchy.
+int cgroup_self_path(char *path, size_t size)
+{
+    char *line = NULL, *mount = NULL, *self = NULL, *field, *p;
+    size_t length = 0;
+    FILE *file;
+    int i, result = -1;
+
+    if ((file = fopen("/proc/self/cgroup", "re")) != NULL) {
+        while (self == NULL && getline(&line, &length, file) != -1) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                self = strdup(line + 3);
+            }
+        }
+        fclose(file);
+    }
+    // Lines are: id parent device root mountpoint options... - type source
+    if (self != NULL && (file = fopen("/proc/self/mountinfo", "re")) != NULL) {
+        while (mount == NULL && getline(&line, &length, file) != -1) {
+            if (strstr(line, " - cgroup2 ") == NULL) {
+                continue;
+            }
+            for (i = 0, field = line; i < 4 && (p = strchr(field, ' ')) != NULL; i++) {
+                field = p + 1;
+            }
+            if (i == 4) {
+                field[strcspn(field, " ")] = '\0';
+                mount = strdup(field);
+            }
+        }
+        fclose(file);
+    }
+    if (mount != NULL && self != NULL
+            && snprintf(path, size, "%s%s", mount, strcmp(self, "/") == 0 ? "" : self) < (int)size) {
+        result = 0;
+    }
+    free(line);
+    free(mount);
+    free(self);
+    return result;
+}
+
+// Makes the smallsh-<pid> directory the jobs' cgroups go in, the first
+// time a job needs one. Returns -1, after turning cgroups off, if it can't.
+int cgroup_setup(void)
+{
+    static const char *controllers[] = { "+memory", "+cpu", "+io", "+pids" };
+    char path[PATH_MAX];
+    int fd, i;
+
+    if (cgroupBaseFD != -1) {
+        return 0;
+    }
+    if (cgroup_self_path(path, sizeof(path)) == -1
+            || snprintf(cgroupBasePath, sizeof(cgroupBasePath), "%s/smallsh-%s", path, shellPid)
+                    >= (int)sizeof(cgroupBasePath)) {
+        fprintf(stderr, "smallsh: cgroups: no cgroup v2 hierarchy, turning cgroups off\n");
+        cgroups = 0;
+        return -1;
+    }
+    if ((mkdir(cgroupBasePath, 0755) == -1 && errno != EEXIST)
+            || (cgroupBaseFD = open(cgroupBasePath, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+        fprintf(stderr, "smallsh: cgroups: %s: %s, turning cgroups off\n", cgroupBasePath, strerror(errno));
+        cgroups = 0;
+        return -1;
+    }
+    // Turn on the controllers the shell's cgroup hands down, one at a
+    // time so a missing one doesn't stop the rest. Stats of controllers
+    // that aren't on are shown as -.
+    fd = openat(cgroupBaseFD, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+    for (i = 0; fd != -1 && i < 4; i++) {
+        if (write(fd, controllers[i], strlen(controllers[i])) == -1) {
+            // Not available here
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return 0;
+}
+
+// Gives a new job a cgroup of its own. On failure the job just runs
+// without one. Returns -1 if it has none.
+int cgroup_job_create(struct job *job, int index)
+{
+    if (cgroup_setup() == -1) {
+        return -1;
+    }
+    snprintf(job->cgroupName, sizeof(job->cgroupName), "job%d-%d", index + 1, ++cgroupSequence);
+    if (mkdirat(cgroupBaseFD, job->cgroupName, 0755) == -1) {
+        perror("smallsh: cgroups");
+        return -1;
+    }
+    job->cgroupFD = openat(cgroupBaseFD, job->cgroupName, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job->cgroupFD == -1) {
+        perror("smallsh: cgroups");
+        unlinkat(cgroupBaseFD, job->cgroupName, AT_REMOVEDIR);
+        return -1;
+    }
+    return 0;
+}
+
+// Removes a finished job's cgroup. Processes the job started that are
+// still running keep it busy, then it is left for cgroup_teardown().
+void cgroup_job_release(struct job *job)
+{
+    close(job->cgroupFD);
+    job->cgroupFD = -1;
+    unlinkat(cgroupBaseFD, job->cgroupName, AT_REMOVEDIR);
+}
+
+// fork() into a cgroup. With clone3() the child starts out in it,
+// otherwise it moves itself in before anything else. Returns like fork().
+pid_t cgroup_fork(int cgroupFD)
+{
+    pid_t pid;
+    int procs;
+#ifdef SYS_clone3
+    static int noClone3 = 0;
+    struct cgroup_clone_args args = {0};
+
+    if (!noClone3) {
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroupFD;
+        pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid != -1) {
+            return pid;
+        }
+        // Kernels before 5.7 don't have it, don't keep asking
+        if (errno == ENOSYS || errno == E2BIG) {
+            noClone3 = 1;
+        }
+    }
+#endif
+    pid = fork();
+    if (pid == 0) {
+        procs = openat(cgroupFD, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (procs == -1 || write(procs, "0", 1) != 1) {
+            perror("smallsh: cgroups");
+        }
+        if (procs != -1) {
+            close(procs);
+        }
+    }
+    return pid;
+}
+
+// Reads a small cgroup file into buffer, NUL terminated. Returns -1 if
+// it isn't there (its controller isn't on).
+int cgroup_read(int dirFD, const char *name, char *buffer, size_t size)
+{
+    ssize_t length;
+    int fd = openat(dirFD, name, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+    length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length < 0) {
+        return -1;
+    }
+    buffer[length] = '\0';
+    return 0;
+}
+
+// Prints a job's memory, CPU and I/O use from its cgroup, for jobs -v
+void cgroup_report(struct job *job)
+{
+    static const char *ioKeys[] = { "rbytes=", "wbytes=", "rios=", "wios=" };
+    char buffer[4096], *p;
+    unsigned long long io[4] = {0};
+    int i;
+
+    if (cgroup_read(job->cgroupFD, "memory.current", buffer, sizeof(buffer)) == 0) {
+        printf("\tmemory.current %s", buffer);
+    } else {
+        printf("\tmemory.current -\n");
+    }
+    // The first three lines are usage_usec, user_usec and system_usec
+    if (cgroup_read(job->cgroupFD, "cpu.stat", buffer, sizeof(buffer)) == 0) {
+        for (i = 0, p = buffer; i < 3 && (p = strchr(p, '\n')) != NULL; i++) {
+            *p = i < 2 ? ' ' : '\0';
+        }
+        printf("\tcpu.stat %s\n", buffer);
+    } else {
+        printf("\tcpu.stat -\n");
+    }
+    // One line per device, add them up
+    if (cgroup_read(job->cgroupFD, "io.stat", buffer, sizeof(buffer)) == 0) {
+        for (i = 0; i < 4; i++) {
+            for (p = buffer; (p = strstr(p, ioKeys[i])) != NULL; p++) {
+                io[i] += strtoull(p + strlen(ioKeys[i]), NULL, 10);
+            }
+        }
+        printf("\tio.stat rbytes %llu wbytes %llu rios %llu wios %llu\n", io[0], io[1], io[2], io[3]);
+    } else {
+        printf("\tio.stat -\n");
+    }
+}
+
+// Kills everything in one job's cgroup. cgroup.kill needs Linux 5.14,
+// before that each process listed in cgroup.procs is killed.
+void cgroup_kill(const char *name)
+{
+    char file[64], buffer[4096], *p;
+    int fd;
+
+    snprintf(file, sizeof(file), "%s/cgroup.kill", name);
+    fd = openat(cgroupBaseFD, file, O_WRONLY | O_CLOEXEC);
+    if (fd != -1 && write(fd, "1", 1) == 1) {
+        close(fd);
+        return;
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    snprintf(file, sizeof(file), "%s/cgroup.procs", name);
+    fd = openat(cgroupBaseFD, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    buffer[length > 0 ? length : 0] = '\0';
+    for (p = buffer; *p != '\0'; p = strchr(p, '\n') ? strchr(p, '\n') + 1 : p + strlen(p)) {
+        kill((pid_t)atoi(p), SIGKILL);
+    }
+}
+
+// Kills every job's cgroup, and any left behind by jobs that are gone,
+// then removes them and the shell's directory. Called on exit.
+void cgroup_teardown(void)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int fd, busy, tries;
+
+    if (cgroupBaseFD == -1 || (fd = dup(cgroupBaseFD)) == -1 || (dir = fdopendir(fd)) == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_DIR && entry->d_name[0] != '.') {
+            cgroup_kill(entry->d_name);
+        }
+    }
+    // The kills take a moment to empty the cgroups, wait up to a second
+    for (tries = 0; tries < 100; tries++) {
+        busy = 0;
+        rewinddir(dir);
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_type == DT_DIR && entry->d_name[0] != '.'
+                    && unlinkat(cgroupBaseFD, entry->d_name, AT_REMOVEDIR) == -1 && errno == EBUSY) {
+                busy = 1;
+            }
+        }
+        if (!busy) {
+            break;
+        }
+        usleep(10000);
+    }
+    closedir(dir);
+    close(cgroupBaseFD);
+    cgroupBaseFD = -1;
+    rmdir(cgroupBasePath);
+}
+
+// Finds the job a fg, bg or wait argument refers to: %n for job n, %%
+// or %+ for the current job, or the pid of one of the job's processes.
+// A NULL spec means the current job. Returns the job's index, or -1
+// after printing a message. SIGCHLD must be blocked.
+int job_parse_spec(const char *spec, const char *builtin)
+{
+    char *end;
+    long n;
+    int index;
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        // The current job may be gone already, use the newest one left
+        if (jobCurrent == -1 || jobTable[jobCurrent].state == JOB_FREE
+                || !jobTable[jobCurrent].background) {
+            jobCurrent = -1;
+            for (index = 0; index < jobCapacity; index++) {
+                if (jobTable[index].state != JOB_FREE && jobTable[index].background) {
+                    jobCurrent = index;
+                }
+            }
+        }
+        if (jobCurrent == -1) {
+            fprintf(stderr, "smallsh: %s: no current job\n", builtin);
+        }
+        return jobCurrent;
+    }
+
+    n = strtol(spec + (spec[0] == '%'), &end, 10);
+    if (*end != '\0' || end == spec + (spec[0] == '%') || n <= 0) {
+        fprintf(stderr, "smallsh: %s: %s: no such job\n", builtin, spec);
+        return -1;
+    }
+    if (spec[0] == '%') {
+        index = (n <= jobCapacity && jobTable[n - 1].state != JOB_FREE) ? n - 1 : -1;
+    } else {
+        index = job_find_pid((pid_t)n);
+    }
+    if (index == -1) {
+        fprintf(stderr, "smallsh: %s: %s: no such job\n", builtin, spec);
+    }
+    return index;
+}
+
+// Continues a stopped job, in the foreground or the background
+void job_continue(int index, int background)
+{
+    struct job *job = &jobTable[index];
+    int i;
+
+    job->background = background;
+    if (job->state == JOB_STOPPED || job->numStopped > 0) {
+        // The handler sees them continue, but they are running again now
+        for (i = 0; i < job->numProcs; i++) {
+            job->procs[i].stopped = 0;
+        }
+        job->numStopped = 0;
+        job->state = JOB_RUNNING;
+        // The terminal first, so it doesn't stop again right away
+        if (!background && monitor && interactive && job->ownGroup) {
+            tcsetpgrp(STDIN_FILENO, job->pgid);
+        }
+        job_signal(job, SIGCONT);
+    }
+}
+
+// Signal handler for SIGTSTP, turns on/off foreground-only mode
+void catchSIGTSTP(int signo){
+    // If background currently allowed, toggle off and send message
+    if(backgroundAllowed == 1)
+    {
+        char* message = "\nEntering foreground-only mode (& is now ignored)\n: ";
+        write(STDOUT_FILENO, message, 52);
+        fflush(stdout);
+        backgroundAllowed = 0;
+    }
+    // If background currently not allowed, toggle on and send message
+    else if(backgroundAllowed == 0)
+    {
+        char* message = "\nExiting foreground-only mode\n: ";
+        write(STDOUT_FILENO, message, 32);
+        fflush(stdout);
+        backgroundAllowed = 1;
+    }
+}
+
+#ifdef HAVE_IO_URING
+// Maps the submission and completion rings of a new io_uring. Returns -1
+// if the kernel doesn't have io_uring or won't give one out.
+int uring_setup(void)
+{
+    struct io_uring_params params;
+    size_t sqSize, cqSize, sqesSize;
+    char *sq, *cq = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, EVENT_ENTRIES, &params);
+    if (fd == -1) {
+        return -1;
+    }
+    sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    // Since Linux 5.4 both rings come in one mapping
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+    }
+    sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (sq != MAP_FAILED) {
+        cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq
+           : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cq != MAP_FAILED && cq != sq) munmap(cq, cqSize);
+        if (sq != MAP_FAILED) munmap(sq, sqSize);
+        close(fd);
+        return -1;
+    }
+
+    eventLoop.fd = fd;
+    eventLoop.sqHead = (unsigned int *)(sq + params.sq_off.head);
+    eventLoop.sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    eventLoop.sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    eventLoop.sqArray = (unsigned int *)(sq + params.sq_off.array);
+    eventLoop.cqHead = (unsigned int *)(cq + params.cq_off.head);
+    eventLoop.cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    eventLoop.cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    eventLoop.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    eventLoop.sqes = sqes;
+    eventLoop.sqEntries = params.sq_entries;
+    // Writes at the current position (O_APPEND, for the trace) need 5.6
+    eventLoop.ringWrites = (params.features & IORING_FEAT_RW_CUR_POS) != 0;
+    return 0;
+}
+
+// Hands the queued submissions to the kernel, and with wait also blocks
+// until at least one request completes. Returns -1 with errno set.
+int uring_enter(int wait)
+{
+    int result = syscall(__NR_io_uring_enter, eventLoop.fd, eventLoop.toSubmit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    // Whatever the kernel took off the ring is no longer queued, even when
+    // the wait itself was interrupted
+    eventLoop.toSubmit = *eventLoop.sqTail - __atomic_load_n(eventLoop.sqHead, __ATOMIC_ACQUIRE);
+    return result < 0 ? -1 : 0;
+}
+
+// Queues a request, filled in further by the caller. It is sent to the
+// kernel by the next uring_enter().
+struct io_uring_sqe *uring_prep(int opcode, int fd, void *addr, unsigned int length,
+        unsigned long long tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail = *eventLoop.sqTail;
+
+    // Ring full, make the kernel take what is queued first
+    if (tail - __atomic_load_n(eventLoop.sqHead, __ATOMIC_ACQUIRE) == eventLoop.sqEntries) {
+        uring_enter(0);
+    }
+    sqe = &eventLoop.sqes[tail & *eventLoop.sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long long)(uintptr_t)addr;
+    sqe->len = length;
+    sqe->user_data = tag;
+    eventLoop.sqArray[tail & *eventLoop.sqMask] = tail & *eventLoop.sqMask;
+    __atomic_store_n(eventLoop.sqTail, tail + 1, __ATOMIC_RELEASE);
+    eventLoop.toSubmit++;
+    return sqe;
+}
+
+// Asks to be told once when fd is readable
+void uring_poll(int fd, int kind)
+{
+    uring_prep(IORING_OP_POLL_ADD, fd, NULL, 0, EVENT_TAG(kind, fd))->poll32_events = POLLIN;
+}
+#endif
+
+// Starts the event loop with the given backend, io_uring falling back to
+// epoll if the kernel doesn't have it (or has it turned off). With
+// EVENT_NONE, or a regular file on stdin, the shell just blocks in read().
+void event_init(int backend)
+{
+    struct epoll_event event;
+    struct stat info;
+
+    if (backend == EVENT_NONE || (fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode))) {
+        return;
+    }
+    sigemptyset(&eventLoop.signals);
+    sigaddset(&eventLoop.signals, SIGCHLD);
+    sigaddset(&eventLoop.signals, SIGTSTP);
+    sigaddset(&eventLoop.signals, SIGIO);
+    eventLoop.signalFD = signalfd(-1, &eventLoop.signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (eventLoop.signalFD == -1) {
+        perror("smallsh: event loop");
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (backend == EVENT_URING && uring_setup() == 0) {
+        eventLoop.backend = EVENT_URING;
+        uring_poll(eventLoop.signalFD, EVENT_SIGNAL);
+        return;
+    }
+#endif
+
+    // Devices that can't be polled, like /dev/null, are just read
+    eventLoop.fd = epoll_create1(EPOLL_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.u64 = EVENT_TAG(EVENT_INPUT, STDIN_FILENO);
+    if (eventLoop.fd != -1 && epoll_ctl(eventLoop.fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == 0) {
+        event.data.u64 = EVENT_TAG(EVENT_SIGNAL, eventLoop.signalFD);
+        if (epoll_ctl(eventLoop.fd, EPOLL_CTL_ADD, eventLoop.signalFD, &event) == 0) {
+            eventLoop.backend = EVENT_EPOLL;
+            return;
+        }
+    }
+    if (eventLoop.fd != -1) {
+        close(eventLoop.fd);
+        eventLoop.fd = -1;
+    }
+    close(eventLoop.signalFD);
+    eventLoop.signalFD = -1;
+}
+
+// Handles one thing the loop woke up for. result is the outcome of an
+// io_uring request, 0 for epoll.
+void event_dispatch(int kind, int fd, int result)
+{
+    struct signalfd_siginfo info;
+
+    switch (kind) {
+    case EVENT_INPUT:
+        eventLoop.inputArmed = 0;
+        eventLoop.inputReady = 1;
+        break;
+
+    // Signals are blocked while waiting, so the handlers are run from here
+    case EVENT_SIGNAL:
+        while (read(eventLoop.signalFD, &info, sizeof(info)) == sizeof(info)) {
+            if (info.ssi_signo == SIGCHLD) {
+                catchSIGCHLD(SIGCHLD);
+            }
+            else if (info.ssi_signo == SIGTSTP) {
+                catchSIGTSTP(SIGTSTP);
+            }
+            else if (info.ssi_signo == SIGIO) {
+                catchSIGIO(SIGIO);
+            }
+        }
+#ifdef HAVE_IO_URING
+        if (eventLoop.backend == EVENT_URING) {
+            uring_poll(eventLoop.signalFD, EVENT_SIGNAL);
+        }
+#endif
+        break;
+
+    case EVENT_WRITE:
+        if (result < 0) {
+            fprintf(stderr, "smallsh: trace: %s\n", strerror(-result));
+        }
+        free(eventLoop.writes[fd]);
+        eventLoop.writes[fd] = NULL;
+        eventLoop.numWrites--;
+        break;
+    }
+}
+
+#ifdef HAVE_IO_URING
+// Handles every completed io_uring request
+void uring_reap(void)
+{
+    struct io_uring_cqe *cqe;
+    unsigned long long tag;
+    unsigned int head = *eventLoop.cqHead;
+    int result;
+
+    while (head != __atomic_load_n(eventLoop.cqTail, __ATOMIC_ACQUIRE)) {
+        cqe = &eventLoop.cqes[head & *eventLoop.cqMask];
+        tag = cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(eventLoop.cqHead, ++head, __ATOMIC_RELEASE);
+        event_dispatch((int)(tag >> 32), (int)(tag & 0xffffffffu), result);
+    }
+}
+#endif
+
+// Blocks until there is input on stdin. Background jobs that finish in
+// the meantime are reported right away, and the prompt printed again,
+// instead of after the next command. SIGCHLD and SIGTSTP are blocked
+// while waiting and come through the signalfd, so one arriving just
+// before the wait still wakes it.
+void event_wait_input(void)
+{
+    struct epoll_event events[8];
+    sigset_t saved;
+    int count, i;
+
+    sigprocmask(SIG_BLOCK, &eventLoop.signals, &saved);
+    eventLoop.inputReady = 0;
+    for (;;) {
+        // Commands queued for agents go out before the shell sleeps, and
+        // remote jobs that finished are counted in before the check
+        if (numRemoteHosts > 0) {
+            remote_flush();
+            if (remoteReady) {
+                remote_service();
+            }
+        }
+        if (jobDoneHead != -1 && interactive) {
+            write(STDOUT_FILENO, "\n", 1);
+            background_check();
+            write(STDOUT_FILENO, ": ", 2);
+        } else {
+            background_check();
+        }
+        if (eventLoop.inputReady) {
+            break;
+        }
+#ifdef HAVE_IO_URING
+        if (eventLoop.backend == EVENT_URING) {
+            if (!eventLoop.inputArmed) {
+                uring_poll(STDIN_FILENO, EVENT_INPUT);
+                eventLoop.inputArmed = 1;
+            }
+            if (uring_enter(1) == -1 && errno != EINTR) {
+                perror("smallsh: event loop");
+                break;
+            }
+            uring_reap();
+            continue;
+        }
+#endif
+        count = epoll_wait(eventLoop.fd, events, 8, -1);
+        if (count == -1 && errno != EINTR) {
+            perror("smallsh: event loop");
+            break;
+        }
+        for (i = 0; i < count; i++) {
+            event_dispatch((int)(events[i].data.u64 >> 32), (int)(events[i].data.u64 & 0xffffffffu), 0);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+// Writes a buffer to fd and frees it. With io_uring the write is queued
+// and the shell goes on, it completes while the shell waits for input.
+void event_write(int fd, char *buffer, size_t length)
+{
+#ifdef HAVE_IO_URING
+    int slot;
+
+    // All slots busy is a burst of jobs, those records are written inline
+    if (eventLoop.backend == EVENT_URING && eventLoop.ringWrites && eventLoop.numWrites < EVENT_ENTRIES) {
+        for (slot = 0; eventLoop.writes[slot] != NULL; slot++);
+        eventLoop.writes[slot] = buffer;
+        eventLoop.numWrites++;
+        // -1 is the current position, the end for O_APPEND
+        uring_prep(IORING_OP_WRITE, fd, buffer, length, EVENT_TAG(EVENT_WRITE, slot))->off = -1ULL;
+        uring_enter(0);
+        return;
+    }
+#endif
+    if (write(fd, buffer, length) != (ssize_t)length) {
+        perror("smallsh: trace");
+    }
+    free(buffer);
+}
+
+// Waits for writes still in flight, before the shell exits
+void event_drain(void)
+{
+#ifdef HAVE_IO_URING
+    sigset_t saved;
+
+    sigprocmask(SIG_BLOCK, &eventLoop.signals, &saved);
+    while (eventLoop.backend == EVENT_URING && eventLoop.numWrites > 0) {
+        if (uring_enter(1) == -1 && errno != EINTR) {
+            break;
+        }
+        uring_reap();
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+#endif
+}
+
+// Makes room for length more bytes at the end of an agent connection's
+// buffer, moving what is left of it down first
+void buffer_reserve(struct remote_buffer *buffer, size_t length)
+{
+    size_t size;
+
+    if (buffer->end + length <= buffer->size) {
+        return;
+    }
+    if (buffer->start > 0) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->end + length > buffer->size) {
+        size = buffer->size ? buffer->size : 4096;
+        while (size < buffer->end + length) size *= 2;
+        buffer->data = realloc(buffer->data, size);
+        if (!buffer->data) {
+            fprintf(stderr, "smallsh: allocation error for remote\n");
+            exit(EXIT_FAILURE);
+        }
+        buffer->size = size;
+    }
+}
+
+// Queues the header of a frame, returns where its payload goes
+char *frame_start(struct remote_buffer *buffer, int type, unsigned int id, size_t length)
+{
+    uint32_t header[3] = { htonl(length), htonl(type), htonl(id) };
+    char *payload;
+
+    buffer_reserve(buffer, sizeof(header) + length);
+    memcpy(buffer->data + buffer->end, header, sizeof(header));
+    payload = buffer->data + buffer->end + sizeof(header);
+    buffer->end += sizeof(header) + length;
+    return payload;
+}
+
+// Queues a whole frame
+void frame_add(struct remote_buffer *buffer, int type, unsigned int id, const void *payload, size_t length)
+{
+    char *to = frame_start(buffer, type, id, length);
+
+    if (length > 0) {
+        memcpy(to, payload, length);
+    }
+}
+
+// Queues a frame whose payload is one or two 32 bit numbers
+void frame_add_numbers(struct remote_buffer *buffer, int type, unsigned int id,
+        int count, uint32_t first, uint32_t second)
+{
+    uint32_t numbers[2] = { htonl(first), htonl(second) };
+
+    frame_add(buffer, type, id, numbers, count * sizeof(uint32_t));
+}
+
+// Takes a number out of a payload, 0 if it is too short for it
+uint32_t frame_number(const char *payload, size_t length, int i)
+{
+    uint32_t number;
+
+    if (length < (i + 1) * sizeof(number)) {
+        return 0;
+    }
+    memcpy(&number, payload + i * sizeof(number), sizeof(number));
+    return ntohl(number);
+}
+
+// Sends as much of what is queued as the socket takes without blocking.
+// Returns -1 if the connection is gone.
+int buffer_flush(int fd, struct remote_buffer *buffer)
+{
+    ssize_t count;
+
+    while (buffer->start < buffer->end) {
+        count = send(fd, buffer->data + buffer->start, buffer->end - buffer->start, MSG_NOSIGNAL);
+        if (count > 0) {
+            buffer->start += count;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    buffer->start = buffer->end = 0;
+    return 0;
+}
+
+// Reads once into a buffer. Returns what read() does.
+ssize_t buffer_fill(int fd, struct remote_buffer *buffer)
+{
+    ssize_t count;
+
+    buffer_reserve(buffer, REMOTE_CHUNK);
+    do {
+        count = read(fd, buffer->data + buffer->end, buffer->size - buffer->end);
+    } while (count == -1 && errno == EINTR);
+    if (count > 0) {
+        buffer->end += count;
+    }
+    return count;
+}
+
+// Takes the next frame out of a buffer, its payload is left in place
+// until the buffer is next added to. Returns 1 with header set to the
+// length, type and id, 0 if the frame hasn't all come in yet, or -1 for
+// one too long to be real.
+int frame_next(struct remote_buffer *buffer, uint32_t header[3], char **payload)
+{
+    size_t have = buffer->end - buffer->start;
+    int i;
+
+    if (have < 3 * sizeof(uint32_t)) {
+        return 0;
+    }
+    for (i = 0; i < 3; i++) {
+        header[i] = frame_number(buffer->data + buffer->start, have, i);
+    }
+    if (header[0] > REMOTE_FRAME_MAX) {
+        return -1;
+    }
+    if (have < 3 * sizeof(uint32_t) + header[0]) {
+        return 0;
+    }
+    *payload = buffer->data + buffer->start + 3 * sizeof(uint32_t);
+    buffer->start += 3 * sizeof(uint32_t) + header[0];
+    if (buffer->start == buffer->end) {
+        buffer->start = buffer->end = 0;
+    }
+    return 1;
+}
+
+// Splits host:port (or [v6 address]:port) in place. A name without a
+// colon is just the port. Returns the port, *host is NULL if none given,
+// or NULL for a port number out of range.
+char *address_split(char *name, char **host)
+{
+    char *colon = strrchr(name, ':');
+    char *port = colon ? colon + 1 : name;
+
+    *host = NULL;
+    if (*port == '\0' || (strspn(port, "0123456789") == strlen(port) && atol(port) > 65535)) {
+        return NULL;
+    }
+    if (colon == NULL) {
+        return port;
+    }
+    *colon = '\0';
+    *host = name;
+    if (name[0] == '[' && colon[-1] == ']') {
+        colon[-1] = '\0';
+        *host = name + 1;
+    }
+    return port;
+}
+
+// Connects to an agent and says hello with the token. The connection
+// then sends SIGIO whenever the agent sends something, so jobs finishing
+// on it wake the shell like SIGCHLD does for local ones.
+// Returns 0, or -1 after printing what went wrong.
+int remote_connect(struct remote_host *host)
+{
+    const char *token = getenv("SMALLSH_REMOTE_TOKEN");
+    struct addrinfo hints = {0}, *addresses, *address;
+    struct timeval timeout = { 5, 0 };
+    struct pollfd pfd;
+    uint32_t header[3];
+    char *name, *node, *port, *payload;
+    int fd = -1, error, one = 1;
+    socklen_t length;
+    ssize_t count;
+
+    if (token == NULL) {
+        fprintf(stderr, "smallsh: remote: SMALLSH_REMOTE_TOKEN is not set\n");
+        return -1;
+    }
+    name = strdup(host->name);
+    if (!name) {
+        fprintf(stderr, "smallsh: allocation error for remote\n");
+        exit(EXIT_FAILURE);
+    }
+    port = address_split(name, &node);
+    if (port == NULL) {
+        fprintf(stderr, "smallsh: remote: %s: invalid port\n", host->name);
+        free(name);
+        return -1;
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(node, port, &hints, &addresses);
+    if (error != 0) {
+        fprintf(stderr, "smallsh: remote: %s: %s\n", host->name, gai_strerror(error));
+        free(name);
+        return -1;
+    }
+    free(name);
+
+    // Non-blocking connects, so a dead host gives up after the timeout
+    errno = ECONNREFUSED;
+    for (address = addresses; address != NULL && fd == -1; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, address->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+            break;
+        }
+        error = errno;
+        if (errno == EINPROGRESS) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            length = sizeof(error);
+            if (poll(&pfd, 1, timeout.tv_sec * 1000) == 1
+                    && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0) {
+                break;
+            }
+            if (error == EINPROGRESS) error = ETIMEDOUT;
+        }
+        close(fd);
+        fd = -1;
+        errno = error;
+    }
+    freeaddrinfo(addresses);
+    if (fd == -1) {
+        fprintf(stderr, "smallsh: remote: %s: %s\n", host->name, strerror(errno));
+        return -1;
+    }
+
+    // The hello is waited for, with the timeout on both directions
+    fcntl(fd, F_SETFL, 0);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    host->in.start = host->in.end = host->out.start = host->out.end = 0;
+    frame_add(&host->out, REMOTE_HELLO, 0, token, strlen(token));
+    if (buffer_flush(fd, &host->out) == -1 || host->out.start != host->out.end) {
+        fprintf(stderr, "smallsh: remote: %s: %s\n", host->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    while ((error = frame_next(&host->in, header, &payload)) == 0) {
+        count = buffer_fill(fd, &host->in);
+        if (count <= 0) {
+            fprintf(stderr, "smallsh: remote: %s: %s\n", host->name,
+                    count == 0 ? "connection closed" : strerror(errno));
+            close(fd);
+            return -1;
         }
     }
+    if (error == -1 || header[1] != REMOTE_WELCOME) {
+        fprintf(stderr, "smallsh: remote: %s: %s\n", host->name,
+                error != -1 && header[1] == REMOTE_REFUSED ? "token refused" : "not an agent");
+        close(fd);
+        return -1;
+    }
+    host->slots = frame_number(payload, header[0], 0);
+    if (host->slots < 1) host->slots = 1;
+    host->others = frame_number(payload, header[0], 1);
+    host->jobs = 0;
 
-    // If command is not built in, passes arguments to be forked and executed
-    return shell_launch(args);
+    timeout.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETFL, O_NONBLOCK | O_ASYNC);
+    host->fd = fd;
+    return 0;
 }
 
-// Function to handle fork/exec of non built in commands
-int shell_launch(char **args)
+// Finishes every job this shell has on an agent with the given status
+void remote_fail(int host, int waitStatus)
 {
-    pid_t pid, wpid;
-    pid = wpid = -5;  // Process id of forked child and wpid to store waitpid() value
-    int inputFD = -5; // File descriptor for input file
-    int outputFD = -5; // File descriptor for output file
+    struct rusage usage = {0};
+    int index;
 
-    pid = fork();
+    for (index = jobLive; index != -1; index = jobTable[index].next) {
+        if (jobTable[index].remoteHost == host && jobTable[index].state != JOB_DONE) {
+            job_process_done(index, 0, waitStatus, &usage);
+        }
+    }
+    remoteHosts[host].jobs = 0;
+}
 
-    if (pid == 0) { // Now inside the child process
-        // Change SIGTSTP to ignore for child processes
-        SIGTSTP_action.sa_handler = SIG_IGN;
-        sigaction(SIGTSTP, &SIGTSTP_action, NULL);
-        // Change SIGINT back to default action for foreground processes
-        // Background processes will continue to ignore SIGINT
-        if(!isBackground) {
-            SIGINT_action.sa_handler = SIG_DFL;
-            sigaction(SIGINT, &SIGINT_action, NULL);
+// Drops an agent's connection, its jobs fail with status 255 like ssh's
+void remote_lost(int host)
+{
+    fprintf(stderr, "smallsh: remote: lost connection to %s\n", remoteHosts[host].name);
+    close(remoteHosts[host].fd);
+    remoteHosts[host].fd = -1;
+    remote_fail(host, 255 << 8);
+}
+
+// Picks the connected agent with the fewest jobs per CPU, counting other
+// shells' jobs as of the last time it said. Returns -1 if none is.
+int remote_pick(void)
+{
+    int i, best = -1;
+    long load, bestLoad = 0;
+
+    for (i = 0; i < numRemoteHosts; i++) {
+        if (remoteHosts[i].fd == -1) {
+            continue;
+        }
+        // Loads are compared as fractions, a/b < c/d being ad < cb
+        load = remoteHosts[i].jobs + remoteHosts[i].others;
+        if (best == -1 || load * remoteHosts[best].slots < bestLoad * remoteHosts[i].slots) {
+            best = i;
+            bestLoad = load;
         }
+    }
+    return best;
+}
 
-        // Logic for I/O redirection, from lecture notes
-
-        // Handle input redirection
-        if (in == 1){
-            inputFD = open(inputFile, O_RDONLY);
-            // Error opening file
-            if (inputFD == -1) { perror("input file open()"); exit(1); }
-            // Otherwise, redirect stdin (0) to inputFile
-            dup2(inputFD, 0);
-        }
-
-        // Handle output redirection
-        if (out ==1){
-            outputFD = open(outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            // Error opening file
-            if (outputFD == -1) { perror("output file open()"); exit(1); }
-            // Otherwise, redirect stdout (1) to outputFile
-            dup2(outputFD, 1);
-        }
-
-        // Handle background I/O when not specified
-        // direct /dev/null to STDIN for input
-        if(isBackground && !in){
-            inputFD = open("/dev/null", O_RDONLY);
-            if (inputFD == -1) { perror("input file open()"); exit(1); }
-            // Redirect input to STDIN from /dev/null
-            dup2(inputFD, 0);
-        }
-        // Direct output from stdout to /dev/null
-        if (isBackground && ! out){
-            outputFD = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            // Error opening file
-            if (outputFD == -1) { perror("output file open()"); exit(1); }
-            // Otherwise, redirect stdout to /dev/null
-            dup2(outputFD, 1);
-        }
-        // Pass args to execvp() and check for error
-        if (execvp(args[0], args) == -1) {
-            perror("smallsh");
+// Sends a signal to a remote job's process group
+void remote_kill(struct job *job, int signo)
+{
+    struct remote_host *host = &remoteHosts[job->remoteHost];
+
+    if (host->fd == -1 || job->state == JOB_DONE) {
+        return;
+    }
+    frame_add_numbers(&host->out, REMOTE_KILL, job->remoteId, 1, signo, 0);
+    remote_flush();
+}
+
+// Sends what is queued for the agents, as far as they take it now. The
+// rest goes when their sockets drain, which raises SIGIO too.
+void remote_flush(void)
+{
+    int i;
+
+    for (i = 0; i < numRemoteHosts; i++) {
+        if (remoteHosts[i].fd != -1 && remoteHosts[i].out.start != remoteHosts[i].out.end
+                && buffer_flush(remoteHosts[i].fd, &remoteHosts[i].out) == -1) {
+            remote_lost(i);
         }
-        // Should only reach if execvp fails
-        exit(EXIT_FAILURE);
+    }
+}
 
-    } else if (pid < 0) {  // Error forking
-        perror("smallsh");
+// Handles a frame from an agent, returns -1 for a broken one
+int remote_frame(int host, uint32_t header[3], char *payload)
+{
+    struct rusage usage = {0};
+    int index, fd;
 
-    } else {  // This is the parent process
-        if(isBackground) {
-            // Print background processs PID
-            printf("background pid is %d\n", pid);
-            fflush(stdout);
-            // Add background process to tracking array
-            bgTracker[numBGProcesses++] = pid;
+    for (index = jobLive; index != -1; index = jobTable[index].next) {
+        if (jobTable[index].remoteHost == host && jobTable[index].remoteId == header[2]
+                && jobTable[index].state != JOB_DONE) {
+            break;
         }
-        // Otherwise, not a background process
-        // Loop and wait for foreground process to finish
-        else{
-            do {
-                wpid = waitpid(pid, &status, WUNTRACED);
-            } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    }
+    // A job that was given up on already, or a frame for the whole host
+    if (index == -1) {
+        return header[1] == REMOTE_EXIT || header[1] == REMOTE_STDOUT || header[1] == REMOTE_STDERR ? 0 : -1;
+    }
+    switch (header[1]) {
+    case REMOTE_STDOUT:
+    case REMOTE_STDERR:
+        fd = jobTable[index].remoteFDs[header[1] == REMOTE_STDOUT ? 1 : 2];
+        if (fd != -1 && write_all(fd, payload, header[0]) == -1 && errno != EPIPE) {
+            perror("smallsh: remote");
+        }
+        return 0;
+    case REMOTE_EXIT:
+        remoteHosts[host].jobs--;
+        remoteHosts[host].others = (int)frame_number(payload, header[0], 1) - remoteHosts[host].jobs;
+        if (remoteHosts[host].others < 0) remoteHosts[host].others = 0;
+        job_process_done(index, 0, frame_number(payload, header[0], 0), &usage);
+        return 0;
+    }
+    return -1;
+}
 
-        // Catch and print signal
-            if (WIFSIGNALED(status)){
-                printf("terminated by signal %d\n", status);
-                fflush(stdout);
+// Handles everything the agents have sent, called when SIGIO says there
+// is something. SIGCHLD and SIGIO must be blocked.
+void remote_service(void)
+{
+    struct remote_host *host;
+    uint32_t header[3];
+    char *payload;
+    ssize_t count;
+    int i, result;
+
+    remoteReady = 0;
+    remote_flush();
+    for (i = 0; i < numRemoteHosts; i++) {
+        host = &remoteHosts[i];
+        while (host->fd != -1) {
+            count = buffer_fill(host->fd, &host->in);
+            result = 0;
+            if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            while (count > 0 && (result = frame_next(&host->in, header, &payload)) == 1) {
+                if (remote_frame(i, header, payload) == -1) {
+                    result = -1;
+                    break;
+                }
+            }
+            if (count <= 0 || result == -1) {
+                remote_lost(i);
             }
         }
     }
+}
 
-    // Clean up files, if any opened
-    // originally set to -5 so here chcking to see if they were
-    // set to something different (i.e. files opened)
-    if(inputFD != -5) close(inputFD);
-    if(outputFD != -5) close(outputFD);
+// Waits for a signal, everywhere the shell used to sigsuspend() on its
+// jobs. With agents connected it sends what is queued for them first and
+// handles what they sent after, which is how remote jobs finish.
+// SIGCHLD and SIGIO must be blocked.
+void shell_suspend(void)
+{
+    if (numRemoteHosts == 0) {
+        sigsuspend(&childMask);
+        return;
+    }
+    remote_flush();
+    if (!remoteReady) {
+        sigsuspend(&childMask);
+    }
+    remote_service();
+}
 
-    // Returns 1 to keep user loop going
+void catchSIGIO(int signo)
+{
+    remoteReady = 1;
+}
+
+// Sets where a remote job's stdout or stderr goes, closing a file it
+// replaces unless the other one still uses it
+void remote_set_output(int fds[3], int which, int fd)
+{
+    if (fds[which] > 2 && fds[which] != fds[3 - which]) {
+        close(fds[which]);
+    }
+    fds[which] = fd;
+}
+
+// Built in remote command, runs commands on agents (smallsh --agent on
+// other machines) and keeps the list of them
+//   remote                    list the agents, their CPUs and jobs
+//   remote -a host:port ...   connect to agents
+//   remote -d host:port       disconnect from one, killing its jobs
+//   remote command [args]     run a command on the least loaded agent
+// The token agents want is taken from SMALLSH_REMOTE_TOKEN. The command
+// reads what a <, << or <<< redirection gives it, or nothing, and its
+// output comes back here, where > and >> files are opened. Remote jobs are
+// in the job table like others, & runs one in the background.
+int shell_remote(struct command *command)
+{
+    struct command shifted = *command;
+    struct remote_host *host;
+    struct redirection *redir;
+    int background = command->background && backgroundAllowed;
+    int fds[3] = { -1, background ? -1 : STDOUT_FILENO, STDERR_FILENO };
+    char *input = NULL, *payload;
+    size_t inputSize = 0, length, sent;
+    int i, fd, job, bad = 0, regular;
+
+    commandStatus = 0;
+    // Listing and managing the agents
+    if (command->argc == 1) {
+        for (i = 0; i < numRemoteHosts; i++) {
+            if (remoteHosts[i].slots > 0) {
+                printf("%s\tcpus %d\tjobs %d\tothers %d\t%s\n", remoteHosts[i].name, remoteHosts[i].slots,
+                        remoteHosts[i].jobs, remoteHosts[i].others, remoteHosts[i].fd != -1 ? "connected" : "lost");
+            }
+        }
+        fflush(stdout);
+        return 1;
+    }
+    if (strcmp(command->argv[1], "-a") == 0 || strcmp(command->argv[1], "-d") == 0) {
+        int add = command->argv[1][1] == 'a';
+
+        if (command->argc < 3 || (!add && command->argc != 3)) {
+            fprintf(stderr, "smallsh: remote: usage: remote [-a host:port... | -d host:port | command...]\n");
+            commandStatus = EXIT_FAILURE << 8;
+            return 1;
+        }
+        sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+        for (i = 2; i < command->argc; i++) {
+            for (fd = 0; fd < numRemoteHosts && strcmp(remoteHosts[fd].name, command->argv[i]) != 0; fd++);
+            if (!add) {
+                if (fd == numRemoteHosts || remoteHosts[fd].slots == 0) {
+                    fprintf(stderr, "smallsh: remote: %s: no such agent\n", command->argv[i]);
+                    commandStatus = EXIT_FAILURE << 8;
+                } else {
+                    // The agent kills the jobs when the connection goes
+                    if (remoteHosts[fd].fd != -1) close(remoteHosts[fd].fd);
+                    remoteHosts[fd].fd = -1;
+                    remote_fail(fd, SIGKILL);
+                    remoteHosts[fd].slots = 0;
+                }
+                continue;
+            }
+            if (fd < numRemoteHosts && remoteHosts[fd].fd != -1) {
+                continue;
+            }
+            // A new one, or one dropped or lost before, connected again
+            if (fd == numRemoteHosts) {
+                remoteHosts = realloc(remoteHosts, (numRemoteHosts + 1) * sizeof(struct remote_host));
+                if (!remoteHosts) {
+                    fprintf(stderr, "smallsh: allocation error for remote\n");
+                    exit(EXIT_FAILURE);
+                }
+                memset(&remoteHosts[fd], 0, sizeof(struct remote_host));
+                remoteHosts[fd].fd = -1;
+                remoteHosts[fd].name = strdup(command->argv[i]);
+                if (!remoteHosts[fd].name) {
+                    fprintf(stderr, "smallsh: allocation error for remote\n");
+                    exit(EXIT_FAILURE);
+                }
+                numRemoteHosts++;
+            }
+            if (remote_connect(&remoteHosts[fd]) == -1) {
+                remoteHosts[fd].slots = 0;
+                commandStatus = EXIT_FAILURE << 8;
+            }
+        }
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        return 1;
+    }
+
+    // Running a command. The agent runs a single program, and only its
+    // three standard descriptors exist to redirect.
+    if (command->next != NULL) {
+        fprintf(stderr, "smallsh: remote: pipelines can't be run remotely\n");
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    for (i = 0; i < command->numRedirs && !bad; i++) {
+        redir = &command->redirs[i];
+        if (redir->fd > 2 || (redir->fd == 0) != (redir->type == REDIR_IN || redir->type == REDIR_HEREDOC
+                || redir->type == REDIR_HERESTRING || redir->type == REDIR_DUP_IN)) {
+            fprintf(stderr, "smallsh: remote: only stdin, stdout and stderr can be redirected\n");
+            bad = 1;
+        } else if (redir->type == REDIR_DUP_IN) {
+            fprintf(stderr, "smallsh: remote: <& can't be sent to an agent\n");
+            bad = 1;
+        } else if (redir->type == REDIR_DUP_OUT) {
+            fd = atoi(redir->target);
+            if (fd != 1 && fd != 2) {
+                fprintf(stderr, "smallsh: remote: only >&1 and >&2 can be sent to an agent\n");
+                bad = 1;
+            } else if (fd != redir->fd) {
+                remote_set_output(fds, redir->fd, fds[fd]);
+            }
+        } else if (redir->fd != 0) {
+            fd = redirect_open(redir);
+            if (fd == -1) {
+                fprintf(stderr, "smallsh: %s: %s\n", redir->target, strerror(errno));
+                bad = 1;
+            } else {
+                remote_set_output(fds, redir->fd, fd);
+            }
+        } else {
+            // Input is read here and sent along, the last one given wins
+            free(input);
+            if (redir->type == REDIR_IN) {
+                input = script_read(redir->target, &inputSize, &regular);
+                if (input == NULL) {
+                    fprintf(stderr, "smallsh: %s: %s\n", redir->target, strerror(errno));
+                    bad = 1;
+                }
+            } else {
+                inputSize = strlen(redir->target);
+                input = malloc(inputSize + 1);
+                if (!input) {
+                    fprintf(stderr, "smallsh: allocation error for remote\n");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(input, redir->target, inputSize);
+                // A here-string ends with a newline
+                if (redir->type == REDIR_HERESTRING) input[inputSize++] = '\n';
+            }
+        }
+    }
+    for (i = 1, length = 1; i < command->argc; i++) {
+        length += strlen(command->argv[i]) + 1;
+    }
+    if (!bad && command->argc < 2) {
+        fprintf(stderr, "smallsh: remote: command needed\n");
+        bad = 1;
+    } else if (!bad && length > REMOTE_FRAME_MAX) {
+        fprintf(stderr, "smallsh: remote: %s\n", strerror(E2BIG));
+        bad = 1;
+    }
+    sigprocmask(SIG_BLOCK, &SIGCHLD_set, NULL);
+    if (!bad && (fd = remote_pick()) == -1) {
+        fprintf(stderr, "smallsh: remote: no agents, add one with remote -a host:port\n");
+        bad = 1;
+    }
+    if (bad) {
+        sigprocmask(SIG_SETMASK, &childMask, NULL);
+        remote_set_output(fds, 1, -1);
+        remote_set_output(fds, 2, -1);
+        free(input);
+        commandStatus = EXIT_FAILURE << 8;
+        return 1;
+    }
+    host = &remoteHosts[fd];
+    shellStats.commands++;
+
+    // The job has no processes here, it stands for the one on the agent
+    // until that sends its exit. Nothing of it is in a cgroup or in a
+    // process group of the terminal.
+    shifted.argv++;
+    shifted.argc--;
+    job = job_create(&shifted, background);
+    if (jobTable[job].cgroupFD != -1) {
+        cgroup_job_release(&jobTable[job]);
+    }
+    jobTable[job].ownGroup = 0;
+    jobTable[job].remoteHost = fd;
+    jobTable[job].remoteId = remoteNextId++;
+    memcpy(jobTable[job].remoteFDs, fds, sizeof(fds));
+    job_add_process(job, 0, 0);
+    jobTable[job].numLive = 1;
+    host->jobs++;
+
+    payload = frame_start(&host->out, REMOTE_RUN, jobTable[job].remoteId, length);
+    *payload++ = fds[1] == -1 ? REMOTE_RUN_NOOUT : 0;
+    for (i = 1; i < command->argc; i++) {
+        payload = stpcpy(payload, command->argv[i]) + 1;
+    }
+    // Input goes in chunks, sent as they are queued up
+    for (sent = 0; sent < inputSize; sent += length) {
+        length = inputSize - sent < REMOTE_CHUNK ? inputSize - sent : REMOTE_CHUNK;
+        frame_add(&host->out, REMOTE_STDIN, jobTable[job].remoteId, input + sent, length);
+        if (host->out.end - host->out.start >= REMOTE_BATCH) {
+            remote_flush();
+        }
+    }
+    frame_add(&host->out, REMOTE_STDIN, jobTable[job].remoteId, NULL, 0);
+    free(input);
+    remote_flush();
+
+    if (background) {
+        printf("background job %d is on %s\n", job + 1, host->name);
+        fflush(stdout);
+    } else {
+        foreground_wait(job);
+        if (WIFSIGNALED(status)) {
+            printf("terminated by signal %d\n", WTERMSIG(status));
+            fflush(stdout);
+        }
+    }
+    commandStatus = background ? 0 : status;
+    sigprocmask(SIG_SETMASK, &childMask, NULL);
     return 1;
 }
 
-// Function to scan list of background processes and return status if any have ended
-void background_check(int size, pid_t bgProcesses[]){
-    int i, childExitMethod;
+// The agent side, smallsh --agent [address:]port. It listens (on
+// 127.0.0.1 unless an address is given) for shells with the same
+// SMALLSH_REMOTE_TOKEN and runs what they send, each job in its own
+// process group with pipes for its input and output. Everything is done
+// from one poll() loop, with SIGCHLD taken through a signalfd. Jobs of a
+// shell that goes away are killed.
+#define AGENT_MAX_CLIENTS 64
+#define AGENT_OUTPUT_MAX (4 << 20) // Output queued for a shell that stops its jobs being read
+#define AGENT_HELLO_MS 10000  // How long a connection has to send the token
+struct agent_client {
+    int fd;             // -1 for a free slot
+    int welcomed;       // Sent the right token
+    struct timespec accepted; // When it connected, for AGENT_HELLO_MS
+    struct remote_buffer in, out;
+};
+struct agent_job {
+    int client;         // Shell it runs for, -1 once that is gone
+    unsigned int id;
+    pid_t pid;
+    int in, out, err;   // Pipes to and from it, -1 once closed
+    int inputDone;      // All input has come, in is closed once it is written
+    struct remote_buffer input;
+    int reaped;
+    int status;
+};
+struct agent_client agentClients[AGENT_MAX_CLIENTS];
+struct agent_job *agentJobs = NULL;
+int numAgentJobs = 0;
+
+// Compares tokens in time that doesn't depend on where they differ
+int agent_token_equal(const char *token, const char *given, size_t length)
+{
+    size_t i, tokenLength = strlen(token);
+    unsigned char difference = tokenLength != length;
+
+    for (i = 0; i < length; i++) {
+        difference |= token[i % (tokenLength ? tokenLength : 1)] ^ given[i];
+    }
+    return difference == 0;
+}
+
+// Writes what input a job has queued into its pipe, as far as it takes
+// it, and closes the pipe once it all went after the last of it came
+void agent_feed(struct agent_job *job)
+{
+    ssize_t count;
+
+    while (job->in != -1 && job->input.start < job->input.end) {
+        count = write(job->in, job->input.data + job->input.start, job->input.end - job->input.start);
+        if (count > 0) {
+            job->input.start += count;
+        } else if (errno == EAGAIN) {
+            return;
+        } else if (errno != EINTR) {
+            // It closed its stdin, the rest is thrown away
+            job->input.start = job->input.end;
+        }
+    }
+    job->input.start = job->input.end = 0;
+    if (job->inputDone && job->in != -1) {
+        close(job->in);
+        job->in = -1;
+    }
+}
 
-    for (i = 0; i < size; i++){
-        // Check to see if process ended
-        pid_t wpid = waitpid(bgProcesses[i], &childExitMethod, WNOHANG);
+// Starts a job from a RUN frame, a flags byte and the NUL terminated argv
+void agent_run(int client, unsigned int id, char *payload, size_t length)
+{
+    struct agent_job *job;
+    char **argv;
+    int inPipe[2] = { -1, -1 }, outPipe[2] = { -1, -1 }, errPipe[2] = { -1, -1 };
+    int flags, argc = 0, fd;
+    size_t i;
+    sigset_t none;
 
-        if(wpid == bgProcesses[i]){
-            if(WIFEXITED(childExitMethod)) {
-                // The child process ended normally
-                printf("background pid %d is done: exit value %d\n", wpid, WEXITSTATUS(childExitMethod));
-                fflush(stdout);
+    if (length < 2 || payload[length - 1] != '\0') {
+        frame_add_numbers(&agentClients[client].out, REMOTE_EXIT, id, 2, EXIT_FAILURE << 8, numAgentJobs);
+        return;
+    }
+    flags = payload[0];
+    for (i = 1; i < length; i++) {
+        if (payload[i] == '\0') argc++;
+    }
+    argv = malloc((argc + 1) * sizeof(char *));
+    agentJobs = realloc(agentJobs, (numAgentJobs + 1) * sizeof(struct agent_job));
+    if (!argv || !agentJobs) {
+        fprintf(stderr, "smallsh: allocation error for agent\n");
+        exit(EXIT_FAILURE);
+    }
+    argv[0] = payload + 1;
+    for (i = 1, argc = 1; i < length - 1; i++) {
+        if (payload[i] == '\0') argv[argc++] = payload + i + 1;
+    }
+    argv[argc] = NULL;
+
+    job = &agentJobs[numAgentJobs];
+    memset(job, 0, sizeof(*job));
+    job->client = client;
+    job->id = id;
+    if (pipe2(inPipe, O_CLOEXEC) == -1 || pipe2(errPipe, O_CLOEXEC) == -1
+            || (!(flags & REMOTE_RUN_NOOUT) && pipe2(outPipe, O_CLOEXEC) == -1)
+            || (job->pid = fork()) == -1) {
+        perror("smallsh: agent");
+        for (i = 0; i < 2; i++) {
+            if (inPipe[i] != -1) close(inPipe[i]);
+            if (outPipe[i] != -1) close(outPipe[i]);
+            if (errPipe[i] != -1) close(errPipe[i]);
+        }
+        free(argv);
+        frame_add_numbers(&agentClients[client].out, REMOTE_EXIT, id, 2, EXIT_FAILURE << 8, numAgentJobs);
+        return;
+    }
+    if (job->pid == 0) {
+        // Child process, in its own group so KILL reaches all of it
+        setpgid(0, 0);
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        if (outPipe[1] == -1) {
+            fd = open("/dev/null", O_WRONLY);
+            outPipe[1] = fd == -1 ? STDOUT_FILENO : fd;
+        }
+        dup2(inPipe[0], STDIN_FILENO);
+        dup2(outPipe[1], STDOUT_FILENO);
+        dup2(errPipe[1], STDERR_FILENO);
+        execvp(argv[0], argv);
+        fprintf(stderr, "smallsh: %s: %s\n", argv[0], strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+    setpgid(job->pid, job->pid);
+    free(argv);
+    close(inPipe[0]);
+    close(errPipe[1]);
+    if (outPipe[1] != -1) close(outPipe[1]);
+    job->in = inPipe[1];
+    job->out = outPipe[0];
+    job->err = errPipe[0];
+    fcntl(job->in, F_SETFL, O_NONBLOCK);
+    numAgentJobs++;
+}
+
+// Finds a shell's job by its id, NULL if it is gone already
+struct agent_job *agent_find(int client, unsigned int id)
+{
+    int i;
+
+    for (i = 0; i < numAgentJobs; i++) {
+        if (agentJobs[i].client == client && agentJobs[i].id == id) {
+            return &agentJobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Closes a shell's connection, killing what it still has running
+void agent_drop(int client)
+{
+    int i;
+
+    close(agentClients[client].fd);
+    free(agentClients[client].in.data);
+    free(agentClients[client].out.data);
+    memset(&agentClients[client], 0, sizeof(struct agent_client));
+    agentClients[client].fd = -1;
+    for (i = 0; i < numAgentJobs; i++) {
+        if (agentJobs[i].client == client) {
+            if (!agentJobs[i].reaped) kill(-agentJobs[i].pid, SIGKILL);
+            agentJobs[i].client = -1;
+        }
+    }
+}
+
+// Handles the frames a shell sent. Returns -1 if it has to be dropped.
+int agent_client_read(int client, const char *token, int cpus)
+{
+    struct agent_client *shell = &agentClients[client];
+    struct agent_job *job;
+    uint32_t header[3];
+    char *payload;
+    ssize_t count;
+    int result;
+
+    count = buffer_fill(shell->fd, &shell->in);
+    if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    if (count <= 0) {
+        return -1;
+    }
+    while ((result = frame_next(&shell->in, header, &payload)) == 1) {
+        if (!shell->welcomed) {
+            // Nothing is taken before the right token
+            if (header[1] != REMOTE_HELLO || !agent_token_equal(token, payload, header[0])) {
+                frame_add(&shell->out, REMOTE_REFUSED, 0, NULL, 0);
+                buffer_flush(shell->fd, &shell->out);
+                return -1;
             }
-            else if (WIFSIGNALED(childExitMethod)){
-                // A signal terminated child process
-                printf("background pid %d is done: terminated by signal %d\n", wpid, WTERMSIG(childExitMethod));
-                fflush(stdout);
+            shell->welcomed = 1;
+            frame_add_numbers(&shell->out, REMOTE_WELCOME, 0, 2, cpus, numAgentJobs);
+            continue;
+        }
+        switch (header[1]) {
+        case REMOTE_RUN:
+            agent_run(client, header[2], payload, header[0]);
+            break;
+        case REMOTE_STDIN:
+            if ((job = agent_find(client, header[2])) == NULL) {
+                break;
+            }
+            if (header[0] == 0) {
+                job->inputDone = 1;
+            } else if (job->in != -1) {
+                buffer_reserve(&job->input, header[0]);
+                memcpy(job->input.data + job->input.end, payload, header[0]);
+                job->input.end += header[0];
+            }
+            agent_feed(job);
+            break;
+        case REMOTE_KILL:
+            job = agent_find(client, header[2]);
+            if (job != NULL && !job->reaped) {
+                kill(-job->pid, frame_number(payload, header[0], 0));
+            }
+            break;
+        }
+    }
+    return result;
+}
+
+// Reads a job's stdout or stderr into frames for its shell, closing the
+// pipe at the end of it
+void agent_job_read(struct agent_job *job, int *fd, int type)
+{
+    char buffer[REMOTE_CHUNK];
+    ssize_t count = read(*fd, buffer, sizeof(buffer));
+
+    if (count == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+    }
+    if (count <= 0) {
+        close(*fd);
+        *fd = -1;
+    } else if (job->client != -1) {
+        frame_add(&agentClients[job->client].out, type, job->id, buffer, count);
+    }
+}
+
+int agent_main(const char *address)
+{
+    const char *token = getenv("SMALLSH_REMOTE_TOKEN");
+    struct addrinfo hints = {0}, *addresses;
+    struct signalfd_siginfo info;
+    struct timespec now;
+    struct pollfd *fds = NULL;
+    struct agent_job *job;
+    char *name, *node, *port;
+    cpu_set_t allowed;
+    sigset_t mask;
+    int *owners = NULL;
+    int listenFD, signalFD, fd, error, one = 1, cpus = 1;
+    int i, numFDs, allocated = 0, waitStatus, timeout;
+    long waited;
+    unsigned int id;
+    pid_t pid;
+
+    if (token == NULL || *token == '\0') {
+        fprintf(stderr, "smallsh: agent: SMALLSH_REMOTE_TOKEN must be set\n");
+        return EXIT_FAILURE;
+    }
+    name = strdup(address);
+    if (!name) {
+        fprintf(stderr, "smallsh: allocation error for agent\n");
+        exit(EXIT_FAILURE);
+    }
+    port = address_split(name, &node);
+    if (port == NULL) {
+        fprintf(stderr, "smallsh: agent: %s: invalid port\n", address);
+        return EXIT_FAILURE;
+    }
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    error = getaddrinfo(node != NULL ? node : "127.0.0.1", port, &hints, &addresses);
+    if (error != 0) {
+        fprintf(stderr, "smallsh: agent: %s: %s\n", address, gai_strerror(error));
+        return EXIT_FAILURE;
+    }
+    listenFD = socket(addresses->ai_family, addresses->ai_socktype | SOCK_CLOEXEC, addresses->ai_protocol);
+    if (listenFD != -1) {
+        setsockopt(listenFD, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+    if (listenFD == -1 || bind(listenFD, addresses->ai_addr, addresses->ai_addrlen) == -1
+            || listen(listenFD, 16) == -1) {
+        fprintf(stderr, "smallsh: agent: %s: %s\n", address, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    freeaddrinfo(addresses);
+    free(name);
+
+    // Jobs are run on the CPUs the agent was given
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        cpus = CPU_COUNT(&allowed);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    // Being told to stop kills the jobs too, they have groups of their own
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signalFD = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signalFD == -1) {
+        perror("smallsh: agent: signalfd");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+        agentClients[i].fd = -1;
+    }
+
+    for (;;) {
+        // Connections that haven't sent the token in time are closed, so
+        // ones that never do can't keep all the slots. poll() wakes up
+        // for the next of them to run out.
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timeout = -1;
+        for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+            if (agentClients[i].fd == -1 || agentClients[i].welcomed) {
+                continue;
+            }
+            waited = (now.tv_sec - agentClients[i].accepted.tv_sec) * 1000
+                    + (now.tv_nsec - agentClients[i].accepted.tv_nsec) / 1000000;
+            if (waited >= AGENT_HELLO_MS) {
+                agent_drop(i);
+            } else if (timeout == -1 || AGENT_HELLO_MS - waited < timeout) {
+                timeout = AGENT_HELLO_MS - waited;
+            }
+        }
+
+        // What to wait on this time round. owners has who each entry is
+        // for: -1 the listening socket, -2 the signalfd, a shell's slot
+        // past AGENT_MAX_CLIENTS, or past twice that a job's index times 4
+        // plus 1 to 3 for its in, out and err
+        if (allocated < 2 + AGENT_MAX_CLIENTS + 3 * numAgentJobs) {
+            allocated = 2 + AGENT_MAX_CLIENTS + 3 * numAgentJobs;
+            fds = realloc(fds, allocated * sizeof(struct pollfd));
+            owners = realloc(owners, allocated * sizeof(int));
+            if (!fds || !owners) {
+                fprintf(stderr, "smallsh: allocation error for agent\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        fds[0].fd = listenFD;
+        fds[0].events = POLLIN;
+        owners[0] = -1;
+        fds[1].fd = signalFD;
+        fds[1].events = POLLIN;
+        owners[1] = -2;
+        numFDs = 2;
+        for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+            if (agentClients[i].fd != -1) {
+                fds[numFDs].fd = agentClients[i].fd;
+                fds[numFDs].events = POLLIN | (agentClients[i].out.start != agentClients[i].out.end ? POLLOUT : 0);
+                owners[numFDs++] = AGENT_MAX_CLIENTS + i;
+            }
+        }
+        for (i = 0; i < numAgentJobs; i++) {
+            job = &agentJobs[i];
+            // A shell that isn't taking the output holds its jobs up
+            int full = job->client != -1
+                && agentClients[job->client].out.end - agentClients[job->client].out.start > AGENT_OUTPUT_MAX;
+            if (job->in != -1 && job->input.start != job->input.end) {
+                fds[numFDs].fd = job->in;
+                fds[numFDs].events = POLLOUT;
+                owners[numFDs++] = 2 * AGENT_MAX_CLIENTS + 4 * i + 1;
+            }
+            if (job->out != -1 && !full) {
+                fds[numFDs].fd = job->out;
+                fds[numFDs].events = POLLIN;
+                owners[numFDs++] = 2 * AGENT_MAX_CLIENTS + 4 * i + 2;
+            }
+            if (job->err != -1 && !full) {
+                fds[numFDs].fd = job->err;
+                fds[numFDs].events = POLLIN;
+                owners[numFDs++] = 2 * AGENT_MAX_CLIENTS + 4 * i + 3;
+            }
+        }
+        if (poll(fds, numFDs, timeout) == -1) {
+            if (errno == EINTR) continue;
+            perror("smallsh: agent: poll");
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < numFDs; i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (owners[i] == -1) {
+                fd = accept4(listenFD, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (fd == -1) continue;
+                for (error = 0; error < AGENT_MAX_CLIENTS && agentClients[error].fd != -1; error++);
+                if (error == AGENT_MAX_CLIENTS) {
+                    close(fd);
+                    continue;
+                }
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                agentClients[error].fd = fd;
+                clock_gettime(CLOCK_MONOTONIC, &agentClients[error].accepted);
+            } else if (owners[i] == -2) {
+                while (read(signalFD, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo != SIGCHLD) {
+                        for (fd = 0; fd < numAgentJobs; fd++) {
+                            if (!agentJobs[fd].reaped) kill(-agentJobs[fd].pid, SIGKILL);
+                        }
+                        return EXIT_SUCCESS;
+                    }
+                }
+                while ((pid = waitpid(-1, &waitStatus, WNOHANG)) > 0) {
+                    for (fd = 0; fd < numAgentJobs && agentJobs[fd].pid != pid; fd++);
+                    if (fd < numAgentJobs) {
+                        agentJobs[fd].reaped = 1;
+                        agentJobs[fd].status = waitStatus;
+                    }
+                }
+            } else if (owners[i] < 2 * AGENT_MAX_CLIENTS) {
+                fd = owners[i] - AGENT_MAX_CLIENTS;
+                if (agentClients[fd].fd == -1) {
+                    continue;
+                }
+                if ((fds[i].revents & POLLOUT)
+                        && buffer_flush(agentClients[fd].fd, &agentClients[fd].out) == -1) {
+                    agent_drop(fd);
+                } else if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                        && agent_client_read(fd, token, cpus) == -1) {
+                    agent_drop(fd);
+                }
+            } else {
+                job = &agentJobs[(owners[i] - 2 * AGENT_MAX_CLIENTS) / 4];
+                switch ((owners[i] - 2 * AGENT_MAX_CLIENTS) % 4) {
+                case 1:
+                    agent_feed(job);
+                    break;
+                case 2:
+                    agent_job_read(job, &job->out, REMOTE_STDOUT);
+                    break;
+                case 3:
+                    agent_job_read(job, &job->err, REMOTE_STDERR);
+                    break;
+                }
+            }
+        }
+
+        // Jobs are over once they are reaped and their output all read.
+        // Those go, swapped with the last, and their shell hears the exit.
+        for (i = numAgentJobs - 1; i >= 0; i--) {
+            job = &agentJobs[i];
+            if (!job->reaped || job->out != -1 || job->err != -1) {
+                continue;
+            }
+            if (job->in != -1) close(job->in);
+            free(job->input.data);
+            fd = job->client;
+            id = job->id;
+            waitStatus = job->status;
+            agentJobs[i] = agentJobs[--numAgentJobs];
+            if (fd != -1) {
+                frame_add_numbers(&agentClients[fd].out, REMOTE_EXIT, id, 2, waitStatus, numAgentJobs);
+            }
+        }
+        for (i = 0; i < AGENT_MAX_CLIENTS; i++) {
+            if (agentClients[i].fd != -1 && agentClients[i].out.start != agentClients[i].out.end
+                    && buffer_flush(agentClients[i].fd, &agentClients[i].out) == -1) {
+                agent_drop(i);
             }
         }
     }
 }
 
-// Function used to cycle through and kill background processes
-void kill_processes(int size, pid_t bgProcesses[]){
+// Benchmark harness for --bench. Each case runs one hot path many times,
+// timing every run on its own, and prints one JSON line with the run
+// time percentiles in nanoseconds:
+//   {"bench":"tokenize","case":"words=32","runs":N,"p50_ns":...,"p90_ns":...,
+//    "p99_ns":...,"max_ns":...}
+#define BENCH_RUNS 20000
+#define BENCH_LAUNCH_RUNS 500
+
+int bench_compare(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+long bench_elapsed(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000000000L + (end->tv_nsec - start->tv_nsec);
+}
+
+// Sorts the samples and prints their percentiles
+void bench_report(const char *bench, const char *name, long *samples, int runs)
+{
+    qsort(samples, runs, sizeof(long), bench_compare);
+    printf("{\"bench\":\"%s\",\"case\":\"%s\",\"runs\":%d,\"p50_ns\":%ld,"
+           "\"p90_ns\":%ld,\"p99_ns\":%ld,\"max_ns\":%ld}\n",
+            bench, name, runs, samples[runs / 2], samples[runs * 9 / 10],
+            samples[runs * 99 / 100], samples[runs - 1]);
+    fflush(stdout);
+}
+
+// Builds a synthetic command line of the given number of words, every
+// dollarEvery-th word being a $ parameter (0 for none)
+char *bench_line(int words, int dollarEvery)
+{
+    static const char *params[] = { "$$", "$?", "${HOME}", "$PATH" };
+    char *line = malloc(words * 16 + 1);
     int i;
 
-    for (i = 0; i < size; i++) {
-        kill(bgProcesses[i], SIGKILL);
+    if (!line) {
+        fprintf(stderr, "smallsh: allocation error for bench\n");
+        exit(EXIT_FAILURE);
+    }
+    line[0] = '\0';
+    for (i = 0; i < words; i++) {
+        if (i > 0) strcat(line, " ");
+        if (dollarEvery > 0 && i % dollarEvery == 0) {
+            strcat(line, params[(i / dollarEvery) % 4]);
+        } else {
+            strcat(line, i % 7 == 3 ? ">out" : "argument");
+        }
     }
+    return line;
 }
 
-// Signal handler for SIGTSTP, turns on/off foreground-only mode
-void catchSIGTSTP(int signo){
-    // If background currently allowed, toggle off and send message
-    if(backgroundAllowed == 1)
-    {
-        char* message = "\nEntering foreground-only mode (& is now ignored)\n: ";
-        write(STDOUT_FILENO, message, 52);
-        fflush(stdout);
-        backgroundAllowed = 0;
+// Runs every benchmark case
+void shell_bench(void)
+{
+    static const int wordCounts[] = { 4, 32, 256 };
+    static const char *builtinNames[] = { "cd", "parallel", "notbuiltin" };
+    long *samples = malloc(BENCH_RUNS * sizeof(long));
+    struct timespec start, end;
+    struct command *command;
+    struct launch_spec spec = {0};
+    char *args[] = { "/bin/true", NULL };
+    spec.cgroupFD = -1;
+    char *line, *copy, name[32];
+    size_t length;
+    int c, run, wstatus;
+    volatile int found = 0;
+    pid_t pid;
+
+    if (!samples) {
+        fprintf(stderr, "smallsh: allocation error for bench\n");
+        exit(EXIT_FAILURE);
     }
-    // If background currently not allowed, toggle on and send message
-    else if(backgroundAllowed == 0)
-    {
-        char* message = "\nExiting foreground-only mode\n: ";
-        write(STDOUT_FILENO, message, 32);
-        fflush(stdout);
-        backgroundAllowed = 1;
+
+    // $ expansion, with one parameter every 4 words or none at all
+    for (c = 0; c < 3; c++) {
+        line = bench_line(wordCounts[c], 4);
+        length = strlen(line) + 1;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            // Expansion works on a copy, like a line in the input buffer
+            copy = arena_alloc(&shellArena, length);
+            memcpy(copy, line, length);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            shell_expand(copy);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            samples[run] = bench_elapsed(&start, &end);
+            arena_reset(&shellArena);
+        }
+        snprintf(name, sizeof(name), "words=%d", wordCounts[c]);
+        bench_report("expand", name, samples, BENCH_RUNS);
+        free(line);
+    }
+
+    // Tokenizing and parsing into a command
+    for (c = 0; c < 3; c++) {
+        line = bench_line(wordCounts[c], 0);
+        length = strlen(line) + 1;
+        for (run = 0; run < BENCH_RUNS; run++) {
+            // The parser writes into the line, so give it a fresh copy
+            copy = arena_alloc(&shellArena, length);
+            memcpy(copy, line, length);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            shell_parse_line(&shellArena, copy, &command);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            samples[run] = bench_elapsed(&start, &end);
+            arena_reset(&shellArena);
+        }
+        snprintf(name, sizeof(name), "words=%d", wordCounts[c]);
+        bench_report("tokenize", name, samples, BENCH_RUNS);
+        free(line);
     }
-}
\ No newline at end of file
+
+    // Builtin lookup, first and last entries and a miss
+    for (c = 0; c < 3; c++) {
+        for (run = 0; run < BENCH_RUNS; run++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            found += builtin_lookup(builtinNames[c]);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            samples[run] = bench_elapsed(&start, &end);
+        }
+        bench_report("dispatch", builtinNames[c], samples, BENCH_RUNS);
+    }
+
+    // Launching /bin/true through each engine, until it is reaped
+    spec.path = "/bin/true";
+    spec.argv = args;
+    spec.pgid = -1;
+    for (c = LAUNCH_SPAWN; c <= LAUNCH_FORK; c++) {
+        for (run = 0; run < BENCH_LAUNCH_RUNS; run++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            pid = (c == LAUNCH_SPAWN) ? launch_spawn(&spec) : launch_fork(&spec);
+            if (pid > 0) {
+                waitpid(pid, &wstatus, 0);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            samples[run] = bench_elapsed(&start, &end);
+        }
+        bench_report("launch", launchEngineNames[c], samples, BENCH_LAUNCH_RUNS);
+    }
+    free(samples);
+}